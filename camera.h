@@ -0,0 +1,103 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <opencv2/opencv.hpp>
+
+// a key frame's camera at one scale
+//  the poses (and the pose's inverse) and the scaled intrinsics are precomputed as fixed-size types,
+//  so the projections don't allocate anything and can be called for every pixel
+class Camera
+{
+public:
+    cv::Matx44f world2cam, cam2world;
+    float fx, fy, cx, cy;
+
+    Camera() : fx(1), fy(1), cx(0), cy(0) {}
+    // pose is the matrix from the world to the camera, the intrinsics are of the camera's resolution
+    Camera(cv::Mat1f const &pose, float _fx, float _fy, float _cx, float _cy)
+        : world2cam(pose), fx(_fx), fy(_fy), cx(_cx), cy(_cy)
+    {
+        cam2world = world2cam.inv();
+    }
+
+    // the camera's position, and its direction vector (in world coord)
+    cv::Vec3f position() const
+    {
+        return cv::Vec3f(cam2world(0,3), cam2world(1,3), cam2world(2,3));
+    }
+    cv::Vec3f direction() const
+    {
+        return cv::normalize(cv::Vec3f(cam2world(0,2), cam2world(1,2), cam2world(2,2)));
+    }
+
+    // transform between the world and the camera coord (a direction vector skips the translation)
+    cv::Vec3f cameraToWorld(cv::Vec3f const &X_c, bool is_point = true) const
+    {
+        return transform(cam2world, X_c, is_point ? 1.0f : 0.0f);
+    }
+    cv::Vec3f worldToCamera(cv::Vec3f const &X_w, bool is_point = true) const
+    {
+        return transform(world2cam, X_w, is_point ? 1.0f : 0.0f);
+    }
+
+    // a pixel (x, y) with its depth z to the camera coord, and back: [x_img, y_img, z_c]
+    cv::Vec3f imgToCamera(float x, float y, float z) const
+    {
+        return cv::Vec3f((x - cx) * z / fx, (y - cy) * z / fy, z);
+    }
+    cv::Vec3f cameraToImg(cv::Vec3f const &X_c) const
+    {
+        return cv::Vec3f((X_c(0) * fx + X_c(2) * cx) / X_c(2), (X_c(1) * fy + X_c(2) * cy) / X_c(2), X_c(2));
+    }
+
+    cv::Vec3f imgToWorld(float x, float y, float z, bool is_point = true) const
+    {
+        return cameraToWorld(imgToCamera(x, y, z), is_point);
+    }
+    cv::Vec3f worldToImg(cv::Vec3f const &X_w) const
+    {
+        return cameraToImg(worldToCamera(X_w));
+    }
+
+    // unproject the n pixels (x0+k, y) of a row with the depths z[k] (all 1 if z is null)
+    //  to the world coord [X[k], Y[k], Z[k]] (the direction vectors if !is_point)
+    void unprojectRow(int x0, int y, int n, const float *z, float *X, float *Y, float *Z, bool is_point = true) const
+    {
+        const float *M = cam2world.val;
+        float w = is_point ? 1.0f : 0.0f;
+        float y_n = (y - cy) / fy;
+#pragma omp simd
+        for ( int k = 0; k < n; k++ ) {
+            float z_c = z ? z[k] : 1.0f;
+            float x_c = (x0 + k - cx) * z_c / fx;
+            float y_c = y_n * z_c;
+            X[k] = M[0] * x_c + M[1] * y_c + M[2]  * z_c + M[3]  * w;
+            Y[k] = M[4] * x_c + M[5] * y_c + M[6]  * z_c + M[7]  * w;
+            Z[k] = M[8] * x_c + M[9] * y_c + M[10] * z_c + M[11] * w;
+        }
+    }
+    // project the n world points [X[k], Y[k], Z[k]] to the image: [x[k], y[k], z[k]] = [x_img, y_img, z_c]
+    void projectRow(int n, const float *X, const float *Y, const float *Z, float *x, float *y, float *z) const
+    {
+        const float *M = world2cam.val;
+#pragma omp simd
+        for ( int k = 0; k < n; k++ ) {
+            float x_c = M[0] * X[k] + M[1] * Y[k] + M[2]  * Z[k] + M[3];
+            float y_c = M[4] * X[k] + M[5] * Y[k] + M[6]  * Z[k] + M[7];
+            float z_c = M[8] * X[k] + M[9] * Y[k] + M[10] * Z[k] + M[11];
+            x[k] = (x_c * fx + z_c * cx) / z_c;
+            y[k] = (y_c * fy + z_c * cy) / z_c;
+            z[k] = z_c;
+        }
+    }
+
+private:
+    static cv::Vec3f transform(cv::Matx44f const &M, cv::Vec3f const &X, float w)
+    {
+        return cv::Vec3f(M(0,0) * X(0) + M(0,1) * X(1) + M(0,2) * X(2) + M(0,3) * w,
+                         M(1,0) * X(0) + M(1,1) * X(1) + M(1,2) * X(2) + M(1,3) * w,
+                         M(2,0) * X(0) + M(2,1) * X(1) + M(2,2) * X(2) + M(2,3) * w);
+    }
+};
+
+#endif // CAMERA_H
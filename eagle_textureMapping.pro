@@ -12,8 +12,12 @@ DESTDIR += ./bin
 OBJECTS_DIR += ./lib
 
 HEADERS += \
+    camera.h \
+    flatmesh.h \
     getalignresults.h \
+    patchkernels.h \
     settings.h \
+    viewslots.h \
     rayint/acc/acceleration.h \
     rayint/acc/bvh_tree.h \
     rayint/acc/defines.h \
@@ -24,7 +28,8 @@ HEADERS += \
     rayint/math/vector.h
 
 SOURCES += main.cpp \
-    getalignresults.cpp
+    getalignresults.cpp \
+    patchkernels.cpp
 
 INCLUDEPATH += ./rayint
 
@@ -0,0 +1,41 @@
+#ifndef FLATMESH_H
+#define FLATMESH_H
+
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PolygonMesh.h>
+
+// the triangle mesh used by every geometry stage
+//  a flat index buffer (3 vertices per face, the faces keep their ids in the PLY file)
+//  and the packed float3 positions and normals, instead of the PolygonMesh's per-face vectors and the padded points
+class FlatMesh
+{
+public:
+    std::vector<uint32_t> indices; // face i => its vertices indices[3i], indices[3i+1], indices[3i+2]
+    std::vector<cv::Vec3f> positions;
+    std::vector<cv::Vec3f> normals; // each vertex's normal (see getAlignResults::calcNormals)
+
+    // built once after loading the PLY file
+    void build(pcl::PolygonMesh const &mesh, pcl::PointCloud<pcl::PointXYZRGB> const &cloud)
+    {
+        indices.resize(mesh.polygons.size() * 3);
+        for ( size_t i = 0; i < mesh.polygons.size(); i++ )
+            for ( size_t v_i = 0; v_i < 3; v_i++ )
+                indices[i * 3 + v_i] = mesh.polygons[i].vertices[v_i];
+        positions.resize(cloud.points.size());
+        for ( size_t i = 0; i < cloud.points.size(); i++ )
+            positions[i] = cv::Vec3f(cloud.points[i].x, cloud.points[i].y, cloud.points[i].z);
+        normals.assign(positions.size(), cv::Vec3f(0, 0, 0));
+    }
+
+    size_t faceNum() const { return indices.size() / 3; }
+    size_t vertexNum() const { return positions.size(); }
+    uint32_t const * face(size_t i) const { return &indices[i * 3]; }
+};
+
+#endif // FLATMESH_H
@@ -12,6 +12,92 @@
 #define EAGLE_MAX(x,y) (x > y ? x : y)
 #define EAGLE_MIN(x,y) (x < y ? x : y)
 #define EAGLE_EQU_F(a,b) (fabs(a-b) <= 1e-6)
+// convert a float to the half float (IEEE 754 binary16, rounded to the nearest even)
+static uint16_t floatToHalf(float f)
+{
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000u;
+    int exp = static_cast<int>((x >> 23) & 0xffu) - 127 + 15;
+    uint32_t mant = x & 0x7fffffu;
+    if ( ((x >> 23) & 0xffu) == 0xffu ) // inf or nan
+        return static_cast<uint16_t>(sign | 0x7c00u | (mant ? 0x200u : 0u));
+    if ( exp >= 31 ) // overflow
+        return static_cast<uint16_t>(sign | 0x7c00u);
+    int shift = 13;
+    uint32_t h = static_cast<uint32_t>(exp << 10);
+    if ( exp <= 0 ) { // subnormal (or zero)
+        if ( exp < -10 )
+            return static_cast<uint16_t>(sign);
+        mant |= 0x800000u;
+        shift = 14 - exp;
+        h = 0;
+    }
+    h |= mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+    if ( rem > mid || (rem == mid && (h & 1u)) )
+        h++; // a carry into the exponent is still right
+    return static_cast<uint16_t>(sign | h);
+}
+
+// the mixing function of SplitMix64
+static uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+// the counter-th random number of the stream key (SplitMix64 as a counter-based generator)
+//  nothing is shared between the threads, and the numbers only depend on the key and the counter,
+//  so they're the same however the work is split
+static uint32_t randomAt(uint64_t key, uint64_t counter)
+{
+    return static_cast<uint32_t>(mix64(key + (counter + 1) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/*----------------------------------------------
+ *  Hash (FNV-1a, to identify the mesh's content)
+ * ---------------------------------------------*/
+static uint64_t hashBuffer(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for ( size_t i = 0; i < size; i++ ) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*----------------------------------------------
+ *  Pixel Order (Z-order of the tiles, and of the pixels in a tile)
+ * ---------------------------------------------*/
+#define PIXEL_ORDER_TILE 8
+#define PIXEL_ORDER_CHUNK (PIXEL_ORDER_TILE * PIXEL_ORDER_TILE)
+// interleave the bits of x and y (x takes the even bits)
+static unsigned int mortonCode(unsigned int x, unsigned int y)
+{
+    unsigned int code = 0;
+    for ( unsigned int b = 0; b < 16; b++ )
+        code |= ((x >> b) & 1u) << (2 * b) | ((y >> b) & 1u) << (2 * b + 1);
+    return code;
+}
+
+/*----------------------------------------------
+ *  Surface Samples (see calcImgRemapping)
+ * ---------------------------------------------*/
+// a sample is keyed by its view's slot and its pixel, the pixels without a sample have NO_SAMPLE
+#define NO_SAMPLE UINT64_MAX
+#define NO_VIEW UINT16_MAX
+static uint64_t sampleKey(size_t slot, size_t pixel_index)
+{
+    return static_cast<uint64_t>(slot) << 32 | static_cast<uint64_t>(pixel_index);
+}
+// keep the smaller key, so the pixel's sample doesn't depend on the order of the threads
+static void claimSample(uint64_t *owner, uint64_t key)
+{
+    uint64_t current = __atomic_load_n(owner, __ATOMIC_RELAXED);
+    while ( key < current && !__atomic_compare_exchange_n(owner, &current, key, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {}
+}
 
 /*----------------------------------------------
  *  Main
@@ -30,6 +116,7 @@ getAlignResults::getAlignResults(Settings &_settings)
         for( size_t i = kfStart; i < kfTotal; i++ )
             kfIndexs.push_back(i);
     }
+    initViewSlots();
     // make the dir to store all files
     processPath = settings.keyFramesPath + "/results_Bi17" + settings.resultsPathSurfix;
     EAGLE::checkPath(processPath);
@@ -50,6 +137,10 @@ getAlignResults::getAlignResults(Settings &_settings)
     LOG("[ To Path: ./results_Bi17" + settings.resultsPathSurfix + " ]" );
     LOG("[ Alpha U: " + std::to_string(settings.alpha_u) + " | Alpha V: " + std::to_string(settings.alpha_v) + " ] ");
     LOG("[ Patch Width: " + std::to_string(settings.patchWidth) + " | Patch Step: " + std::to_string(settings.patchStep) + " | Patch Random Search: " + std::to_string(settings.patchRandomSearchTimes) + " ]");
+    patchKernel = patchKernels(settings.patchWidth);
+    LOG("[ Patch Kernels: " + std::string(patchKernel.ssdName) + (patchKernel.unrolled ? " | Unrolled " : " | Generic ") + std::to_string(settings.patchWidth) + "x" + std::to_string(settings.patchWidth) + " ]");
+    patchmatchSweeps = 0;
+    LOG("[ Random Seed: " + std::to_string(settings.randomSeed) + " ]");
     LOG("[ Scale: " + std::to_string(settings.scaleTimes) + " | From " + std::to_string(settings.scaleInitW) + "x" + std::to_string(settings.scaleInitH) + " to " + std::to_string(settings.originImgW) + "x" + std::to_string(settings.originImgH) + " ]");
 
     //pcl::PolygonMesh mesh;
@@ -61,7 +152,11 @@ getAlignResults::getAlignResults(Settings &_settings)
     cloud_rgb = pcl::PointCloud<pcl::PointXYZRGB>();
     // convert to PointCloud
     pcl::fromPCLPointCloud2(mesh.cloud, cloud_rgb);
+    // the flat mesh used by all geometry stages
+    flatMesh.build(mesh, cloud_rgb);
     calcNormals();
+    if ( settings.visibilityType != 'z' )
+        initScene();
 
     readDepthImgs();
 
@@ -79,6 +174,19 @@ getAlignResults::getAlignResults(Settings &_settings)
     double all_seconds = static_cast<double>( (end_time - start_time) / CLOCKS_PER_SEC );
     LOG("[ Finish in " + std::to_string(all_seconds) + " s ]");
 }
+// every view's data is stored at its slot (the position in kfIndexs)
+void getAlignResults::initViewSlots()
+{
+    sourcesFiles.init(kfIndexs); targetsFiles.init(kfIndexs); texturesFiles.init(kfIndexs);
+    sourcesImgs.init(kfIndexs); targetsImgs.init(kfIndexs); texturesImgs.init(kfIndexs);
+    depthImgs.init(kfIndexs); scaleDepthImgs.init(kfIndexs);
+    img_valid_info.init(kfIndexs); weights.init(kfIndexs);
+    origin_valid_info.init(kfIndexs); origin_weights.init(kfIndexs);
+    img_valid_patch.init(kfIndexs);
+    mappings.init(kfIndexs); sampleOwners.init(kfIndexs);
+    overlapViews.init(kfIndexs); covisibleViews.init(kfIndexs);
+    nnf_s2t.init(kfIndexs); nnf_t2s.init(kfIndexs);
+}
 getAlignResults::~getAlignResults()
 {
     log.close();
@@ -88,10 +196,8 @@ getAlignResults::~getAlignResults()
     texturesImgs.clear();
 
     weights.clear();
-    for( size_t t : kfIndexs ) {
-        mappings[t].clear();
-    }
     mappings.clear();
+    sampleOwners.clear();
 }
 
 /*----------------------------------------------
@@ -141,36 +247,60 @@ void getAlignResults::readDepthImgs()
             depthImgs[i] = cv::imread(file, CV_LOAD_IMAGE_UNCHANGED);
     }
 }
-float getAlignResults::getDepth(size_t img_i, int x, int y)
+// decode a depth image of the type T to metres (divided by unit), resampled to w*h by the nearest pixel
+//  ( the pixel (x,y) takes the depth at round(x/w*originW), round(y/h*originH), clamped to the depth image )
+template <typename T>
+static cv::Mat1f resampleDepth(cv::Mat const &depth, int w, int h, int originW, int originH, float unit)
 {
-    if ( depthImgs.empty() == true ) {
-        return -1.0f;
-    }
-    x = static_cast<int>(round(1.0 * x / settings.imgW * settings.originDepthW));
-    y = static_cast<int>(round(1.0 * y / settings.imgH * settings.originDepthH));
-    float v = 0;
-    switch(settings.depthType) {
-    case 'f' :
-        v = depthImgs[img_i].at<float>(y, x);
-        break;
-    case 'i' : {
-        int t_i = depthImgs[img_i].at<int>(y, x);
-        v = static_cast<float>(t_i) * 1.0f / 1000;
-        break;
+    std::vector<int> cols(static_cast<size_t>(w));
+    for ( int x = 0; x < w; x++ ) {
+        int d_x = static_cast<int>(round(1.0 * x / w * originW));
+        cols[x] = EAGLE_MAX(EAGLE_MIN(d_x, depth.cols - 1), 0);
     }
-    case 's' : {
-        unsigned short t_u = depthImgs[img_i].at<ushort>(y, x);
-        v = static_cast<float>(t_u) * 1.0f / 1000;
-        break;
+    cv::Mat1f out(h, w);
+#pragma omp parallel for
+    for ( int y = 0; y < h; y++ ) {
+        int d_y = static_cast<int>(round(1.0 * y / h * originH));
+        const T *row = depth.ptr<T>( EAGLE_MAX(EAGLE_MIN(d_y, depth.rows - 1), 0) );
+        float *out_row = out.ptr<float>(y);
+        for ( int x = 0; x < w; x++ )
+            out_row[x] = static_cast<float>(row[cols[x]]) * 1.0f / unit;
     }
-    case 'b' : {
-        unsigned char t_u = depthImgs[img_i].at<uchar>(y, x);
-        v = static_cast<float>(t_u) * 1.0f / 1000;
-        break;
+    return out;
+}
+// resample every depth image to the current resolution (in metres), called once at each scale
+void getAlignResults::calcScaleDepths()
+{
+    scaleDepthImgs.clear();
+    for ( size_t i : kfIndexs ) {
+        cv::Mat const & depth = depthImgs[i];
+        if ( depth.empty() )
+            continue;
+        cv::Mat1f & out = scaleDepthImgs[i];
+        switch(settings.depthType) {
+        case 'f' :
+            out = resampleDepth<float>(depth, settings.imgW, settings.imgH, settings.originDepthW, settings.originDepthH, 1.0f);
+            break;
+        case 'i' :
+            out = resampleDepth<int>(depth, settings.imgW, settings.imgH, settings.originDepthW, settings.originDepthH, 1000.0f);
+            break;
+        case 's' :
+            out = resampleDepth<ushort>(depth, settings.imgW, settings.imgH, settings.originDepthW, settings.originDepthH, 1000.0f);
+            break;
+        case 'b' :
+            out = resampleDepth<uchar>(depth, settings.imgW, settings.imgH, settings.originDepthW, settings.originDepthH, 1000.0f);
+            break;
+        }
     }
+}
+// the ground truth depth of the pixel (x,y) at the current resolution, -1 if there is no depth image
+float getAlignResults::getDepth(size_t img_i, int x, int y)
+{
+    cv::Mat1f const & depth = scaleDepthImgs[img_i];
+    if ( depth.empty() == true ) {
+        return -1.0f;
     }
-    //std::cout << "[(" << x << "," << y << ") " << v << "]" << std::flush;
-    return v;
+    return depth.ptr<float>(y)[x];
 }
 
 /*----------------------------------------------
@@ -226,59 +356,18 @@ void getAlignResults::readCameraTraj()
         std::cout << cameraPoses[i] << std::endl; */
 }
 
-// project the point from the camera coord to the world coordinate system
-cv::Mat getAlignResults::cameraToWorld(cv::Mat X_c, size_t id)
-{
-    cv::Mat R = cameraPoses[id]; // from world to camera
-    return R.inv() * X_c;
-}
-// project the point from the world to the (id)th camera's coordinate system
-cv::Mat getAlignResults::worldToCamera(cv::Mat X_w, size_t id)
-{
-    cv::Mat R = cameraPoses[id]; // from world to camera
-    return R * X_w;
-}
-
-// project a pixel to the camera coord
-cv::Mat getAlignResults::imgToCamera(int x, int y, float z)
-{
-    float cx = settings.cameraCx / static_cast<float>(scaleF);
-    float cy = settings.cameraCy / static_cast<float>(scaleF);
-    float fx = settings.cameraFx / static_cast<float>(scaleF);
-    float fy = settings.cameraFy / static_cast<float>(scaleF);
-
-    float z_c = z;
-    float x_c = (x * 1.0f - cx) * z_c / fx;
-    float y_c = (y * 1.0f - cy) * z_c / fy;
-    return (cv::Mat_<float>(4, 1) << x_c, y_c, z_c, 1);
-}
-cv::Mat getAlignResults::cameraToImg(cv::Mat X_c)
-{
-    float cx = settings.cameraCx / static_cast<float>(scaleF);
-    float cy = settings.cameraCy / static_cast<float>(scaleF);
-    float fx = settings.cameraFx / static_cast<float>(scaleF);
-    float fy = settings.cameraFy / static_cast<float>(scaleF);
-
-    float x = (X_c.at<float>(0) * fx + X_c.at<float>(2) * cx) / X_c.at<float>(2);
-    float y = (X_c.at<float>(1) * fy + X_c.at<float>(2) * cy) / X_c.at<float>(2);
-    float z = X_c.at<float>(2);
-    return (cv::Mat_<float>(3, 1) << x, y, z);
-}
-
-// project a pixel to the world coord system
-cv::Mat getAlignResults::imgToWorld(int x, int y, float z, size_t id, int is_point)
+// the (id)th camera at the current scale, with the fixed-size matrices for the per-pixel projections
+//  (all cameras are rebuilt when the scale changes, so don't call it inside a parallel loop)
+Camera const & getAlignResults::getCamera(size_t id)
 {
-    cv::Mat X_c = imgToCamera(x, y, z);
-    X_c.at<float>(3) = is_point * 1.0f;
-    return cameraToWorld(X_c, id);
-}
-// project the point to the (id)th image's plane (on origin-resolution)
-//   X_w is the point's world position [x_w, y_w, z_w, 1]
-//   return 3*1 matrix [x_img, y_img, z_c]
-cv::Mat getAlignResults::worldToImg(cv::Mat X_w, size_t id)
-{
-    cv::Mat X_c = worldToCamera(X_w, id);
-    return cameraToImg(X_c);
+    if ( camerasScaleF != scaleF || cameras.size() != cameraPoses.size() ) {
+        float s = static_cast<float>(scaleF);
+        cameras.clear();
+        for ( cv::Mat1f const & pose : cameraPoses )
+            cameras.push_back( Camera(pose, settings.cameraFx / s, settings.cameraFy / s, settings.cameraCx / s, settings.cameraCy / s) );
+        camerasScaleF = scaleF;
+    }
+    return cameras[id];
 }
 
 /*----------------------------------------------
@@ -315,9 +404,8 @@ bool getAlignResults::pointProjectionValid(float point_z, size_t img_id, int x,
         return false;
     // get the position's valid info
     size_t p_index = static_cast<size_t>(x + y * settings.imgW);
-    struct valid_info * info = &img_valid_info[img_id][p_index];
     // check the depth (whether the point is occluded)
-    if ( point_z > info->depth + 0.01f )
+    if ( point_z > img_valid_info[img_id].depth[p_index] + 0.01f )
         return false;
     // check the weight (if the weight is too small, then it's a bad projection)
     if ( weights[img_id].at<float>(y, x) < 0.1f )
@@ -326,24 +414,57 @@ bool getAlignResults::pointProjectionValid(float point_z, size_t img_id, int x,
     return true;
 }
 
+// the pixels' indexes of the current resolution in the tiled Z-order, which the single rays (castImgRays)
+//  and the shading of the hits walk through, so the neighbouring pixels (which share the BVH's nodes) are handled together,
+//  and each chunk of PIXEL_ORDER_CHUNK is a compact tile instead of a long strip of a row
+//  (the ray packets are already tiles of their own, and the remapping works by rows for unprojectRow/projectRow)
+std::vector<unsigned int> const & getAlignResults::getPixelOrder()
+{
+    if ( pixelOrderW == settings.imgW && pixelOrderH == settings.imgH )
+        return pixelOrder;
+    int tiles_x = (settings.imgW + PIXEL_ORDER_TILE - 1) / PIXEL_ORDER_TILE;
+    int tiles_y = (settings.imgH + PIXEL_ORDER_TILE - 1) / PIXEL_ORDER_TILE;
+    std::vector<unsigned int> tiles(static_cast<size_t>(tiles_x * tiles_y));
+    for ( size_t t = 0; t < tiles.size(); t++ )
+        tiles[t] = static_cast<unsigned int>(t);
+    std::sort(tiles.begin(), tiles.end(), [tiles_x](unsigned int a, unsigned int b) {
+        return mortonCode(a % tiles_x, a / tiles_x) < mortonCode(b % tiles_x, b / tiles_x);
+    });
+    pixelOrder.clear();
+    pixelOrder.reserve(static_cast<size_t>(settings.imgW * settings.imgH));
+    for ( unsigned int t : tiles ) {
+        int x0 = static_cast<int>(t % tiles_x) * PIXEL_ORDER_TILE;
+        int y0 = static_cast<int>(t / tiles_x) * PIXEL_ORDER_TILE;
+        for ( unsigned int k = 0; k < PIXEL_ORDER_CHUNK; k++ ) {
+            int x = x0, y = y0;
+            for ( unsigned int b = 0; (1u << (2 * b)) < PIXEL_ORDER_CHUNK; b++ ) {
+                x += static_cast<int>((k >> (2 * b)) & 1u) << b;
+                y += static_cast<int>((k >> (2 * b + 1)) & 1u) << b;
+            }
+            if ( x < settings.imgW && y < settings.imgH )
+                pixelOrder.push_back(static_cast<unsigned int>(x + y * settings.imgW));
+        }
+    }
+    pixelOrderW = settings.imgW;
+    pixelOrderH = settings.imgH;
+    return pixelOrder;
+}
+
 /*----------------------------------------------
  *  Pre-Process
  * ---------------------------------------------*/
 void getAlignResults::calcNormals()
 {
     LOG("[ Calculating Normals of each Vertex ]");
-    //std::vector<cv::Vec3f> vertex_normal(point_num); // vertex id => cv::Vec3f
-    vertex_normal.resize(point_num);
+    std::vector<cv::Vec3f> & vertex_normal = flatMesh.normals; // vertex id => cv::Vec3f
+    vertex_normal.assign(point_num, cv::Vec3f(0, 0, 0));
     // store each vertex's total weight angle
     std::vector<float> vertex_angle(point_num);
 
     for( size_t i = 0; i < mesh_num; i++ ) {
-        std::vector<cv::Vec3f> v(3);
-        for( size_t v_i = 0; v_i < 3; v_i++ ) {
-            size_t p_i = mesh.polygons[i].vertices[v_i];
-            cv::Vec3f v_(cloud_rgb.points[p_i].x, cloud_rgb.points[p_i].y, cloud_rgb.points[p_i].z);
-            v[v_i] = v_; // store the current mesh's points coords
-        }
+        uint32_t const * face = flatMesh.face(i);
+        // the current mesh's points coords
+        cv::Vec3f v[3] = { flatMesh.positions[face[0]], flatMesh.positions[face[1]], flatMesh.positions[face[2]] };
         cv::Vec3f e1 = v[1] - v[0];
         cv::Vec3f e2 = v[2] - v[1];
         cv::Vec3f fn = cv::normalize(e1.cross(e2)); // current mesh's normal
@@ -356,7 +477,7 @@ void getAlignResults::calcNormals()
         t[0] = acos(cos_t0); t[1] = acos(cos_t1); t[2] = acos(cos_t2);
 
         for( size_t v_i = 0; v_i < 3; v_i++ ) {
-            size_t p_i = mesh.polygons[i].vertices[v_i];
+            size_t p_i = face[v_i];
             vertex_normal[p_i] += fn * t[v_i];
             vertex_angle[p_i] += static_cast<float>(t[v_i]);
         }
@@ -367,52 +488,440 @@ void getAlignResults::calcNormals()
         vertex_normal[i] /= vertex_angle[i];
 }
 
+// build the scene shared by all scales (the mesh never changes)
+void getAlignResults::initScene()
+{
+    LOG("[ Building the BVH of the Mesh ]");
+    std::vector<unsigned int> const & faces = flatMesh.indices;
+    std::vector<math::Vec3f> vertices(point_num);
+    for(size_t i = 0; i < point_num; i++) {
+        cv::Vec3f const & p = flatMesh.positions[i];
+        vertices[i] = math::Vec3f( p(0), p(1), p(2) );
+    }
+    if ( !settings.bvhCache ) {
+        meshBVH = BVHTree::create(faces, vertices);
+    } else {
+        // the BVH file is stored next to the PLY file, and only used when the mesh's content is the same
+        std::string cache_file = settings.keyFramesPath + "/" + settings.plyFile + ".bvh";
+        uint64_t key = hashBuffer(vertices.data(), vertices.size() * sizeof(math::Vec3f),
+                                  hashBuffer(faces.data(), faces.size() * sizeof(unsigned int)));
+        meshBVH = BVHTree::load(cache_file, key);
+        if ( meshBVH ) {
+            LOG("[ BVH Loaded from " + cache_file + " ]");
+        } else {
+            meshBVH = BVHTree::create(faces, vertices);
+            if ( meshBVH->save(cache_file, key) )
+                LOG("[ BVH Saved to " + cache_file + " ]");
+        }
+    }
+    // the 4-wide tree isn't cached, collapsing it from the binary one is cheap,
+    //  and only the single rays traverse it (the packets always use the binary tree), see calcImgValidMesh
+    bool single_rays = settings.visibilityType != 'z' &&
+            settings.rayPacketSize != 4 && settings.rayPacketSize != 8 && settings.rayPacketSize != 16;
+    if ( settings.bvhWide && single_rays && !meshBVH->build_wide4() )
+        LOG("[ BVH4 not Built (the tree is too deep or a single leaf), the Binary Traversal is Used ]");
+}
+// the BVH of the mesh, which is built at the first call if the scene hasn't been inited
+getAlignResults::BVHTree const & getAlignResults::getMeshBVH()
+{
+    if ( !meshBVH )
+        initScene();
+    return *meshBVH;
+}
+
 // calculate valid mesh for each pixel on every image
 void getAlignResults::calcValidMesh()
 {
     LOG("[ Calculating Depth, Distance and Weight ]");
 
-    // init ray intersection
-    std::vector<unsigned int> faces(mesh_num * 3);
-    for( size_t i = 0; i < mesh_num; i++ ) {
-        for( size_t v_i = 0; v_i < 3; v_i++ )
-            faces[i * 3 + v_i] = mesh.polygons[i].vertices[v_i];
+    // the BVH is only needed when casting rays
+    BVHTree const *bvhtree = nullptr;
+    if ( settings.visibilityType != 'z' )
+        bvhtree = &getMeshBVH();
+
+    // with validMeshFromOrigin, only the first call does the work (at the origin resolution),
+    //  and every scale reduces these results to its resolution
+    bool from_origin = settings.validMeshFromOrigin;
+    if ( from_origin && !origin_valid_info.atSlot(0).empty() ) {
+        calcValidMeshFromOrigin();
+        return;
     }
-    std::vector<math::Vec3f> vertices(point_num);
-    for(size_t i = 0; i < point_num; i++) {
-        math::Vec3f v( cloud_rgb.points[i].x, cloud_rgb.points[i].y, cloud_rgb.points[i].z );
-        vertices[i] = v;
+    int imgW = settings.imgW, imgH = settings.imgH;
+    double _scaleF = scaleF;
+    if ( from_origin ) {
+        settings.imgW = settings.originImgW;
+        settings.imgH = settings.originImgH;
+        scaleF = 1.0;
     }
-    BVHTree bvhtree(faces, vertices);
 
-    img_valid_info.clear(); // pixel_index => valid_info
+    img_valid_info.clear(); // pixel_index => valid info
     weights.clear();
     size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
     for( size_t t : kfIndexs ) {
-        img_valid_info[t] = std::vector<struct valid_info>(total);
+        img_valid_info[t].reset(total, settings.validCosAlpha);
         weights[t] = cv::Mat1f( settings.imgH, settings.imgW, 0.0 );
-        for ( size_t pixel_index = 0; pixel_index < total; pixel_index++) {
-            struct valid_info info;
-            img_valid_info[t][pixel_index] = info;
-        }
         LOG( " " + std::to_string(t) + " << ", false );
         calcImgValidMesh(t, bvhtree);
         LOG( " ", true );
     }
+
+    if ( from_origin ) {
+        origin_valid_info.swap(img_valid_info);
+        origin_weights.swap(weights);
+        settings.imgW = imgW;
+        settings.imgH = imgH;
+        scaleF = _scaleF;
+        calcValidMeshFromOrigin();
+    }
 }
-// using the ray intersection method to get the pixel's depth
-void getAlignResults::calcImgValidMesh(size_t img_i, BVHTree &bvhtree)
+// get the valid mesh of the current scale from the origin resolution's
+void getAlignResults::calcValidMeshFromOrigin()
 {
-    // calc the camera's position (in world coord)
-    cv::Mat cam_c = (cv::Mat_<float>(4, 1) << 0, 0, 0, 1);
-    cv::Mat cam_w = cameraToWorld(cam_c, img_i);
-    math::Vec3f cam_world_p(cam_w.at<float>(0), cam_w.at<float>(1), cam_w.at<float>(2));
+    img_valid_info.clear();
+    weights.clear();
+    LOG( " Reduce from " + std::to_string(settings.originImgW) + "x" + std::to_string(settings.originImgH) + " << ", false );
+    for( size_t t : kfIndexs ) {
+        img_valid_info[t].reset( static_cast<size_t>(settings.imgW * settings.imgH), settings.validCosAlpha );
+        weights[t] = cv::Mat1f( settings.imgH, settings.imgW, 0.0 );
+        calcImgValidMeshFromOrigin(t);
+        LOG( std::to_string(t) + " ", false );
+    }
+    LOG( "<< Done" );
+}
+// a pixel (x,y) of the current scale casts its ray through (x*scaleF, y*scaleF) of the origin resolution,
+//  so it covers the origin pixels within [x-0.5, x+0.5)*scaleF * [y-0.5, y+0.5)*scaleF :
+//  the nearest one (minimal depth) gives its depth and mesh, the weight is averaged by the covered area
+void getAlignResults::calcImgValidMeshFromOrigin(size_t img_i)
+{
+    struct valid_planes & valid = img_valid_info[img_i];
+    struct valid_planes const & origin_valid = origin_valid_info[img_i];
+    cv::Mat1f weight_i = weights[img_i];
+    cv::Mat1f const origin_weight_i = origin_weights[img_i];
+    double sx = settings.originImgW * 1.0 / settings.imgW;
+    double sy = settings.originImgH * 1.0 / settings.imgH;
+    size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
+#pragma omp parallel for
+    for ( size_t pixel_index = 0; pixel_index < total; pixel_index++) {
+        int y = static_cast<int>(pixel_index) / settings.imgW;
+        int x = static_cast<int>(pixel_index) % settings.imgW;
+        int x0 = EAGLE_MAX( static_cast<int>(std::ceil((x - 0.5) * sx)), 0 );
+        int x1 = EAGLE_MIN( static_cast<int>(std::ceil((x + 0.5) * sx)), settings.originImgW );
+        int y0 = EAGLE_MAX( static_cast<int>(std::ceil((y - 0.5) * sy)), 0 );
+        int y1 = EAGLE_MIN( static_cast<int>(std::ceil((y + 0.5) * sy)), settings.originImgH );
+        size_t nearest = 0;
+        float nearest_depth = 0;
+        float sum_weight = 0;
+        for ( int oy = y0; oy < y1; oy++ ) {
+            const float *depth_row = &origin_valid.depth[static_cast<size_t>(oy * settings.originImgW)];
+            for ( int ox = x0; ox < x1; ox++ ) {
+                float depth = depth_row[ox];
+                if ( depth <= 0 )
+                    continue;
+                if ( nearest_depth <= 0 || depth < nearest_depth ) {
+                    nearest = static_cast<size_t>(ox + oy * settings.originImgW);
+                    nearest_depth = depth;
+                }
+                sum_weight += origin_weight_i(oy, ox);
+            }
+        }
+        if ( nearest_depth > 0 ) {
+            valid.depth[pixel_index] = nearest_depth;
+            valid.mesh_id[pixel_index] = origin_valid.mesh_id[nearest];
+            if ( !valid.cos_alpha.empty() )
+                valid.cos_alpha[pixel_index] = origin_valid.cos_alpha[nearest];
+            weight_i(y, x) = sum_weight / ((x1 - x0) * (y1 - y0));
+        }
+    }
+
+    cv::Mat weight_out;
+    weight_i.convertTo(weight_out, CV_8UC1, 255, 0);
+    cv::imwrite(weightsPath + "/weight_"+std::to_string(img_i)+".png", weight_out);
+}
+// cast one ray for each pixel
+void getAlignResults::castImgRays(BVHTree const &bvhtree, math::Vec3f const &origin, std::vector<math::Vec3f> const &rays_dir, std::vector<BVHTree::Hit> &hits)
+{
+    size_t total = rays_dir.size();
+    std::vector<unsigned int> const & order = getPixelOrder();
+#pragma omp parallel for schedule(dynamic, PIXEL_ORDER_CHUNK)
+    for ( size_t k = 0; k < total; k++) {
+        size_t pixel_index = order[k];
+        BVHTree::Ray ray;
+        ray.origin = origin;
+        ray.dir = rays_dir[pixel_index];
+        ray.tmin = 0.0f;
+        ray.tmax = std::numeric_limits<float>::infinity();
+        bvhtree.intersect(ray, &hits[pixel_index]);
+    }
+}
+// cast the rays of each TW*TH pixels' tile as a packet
+//  (the rays from one camera are coherent, so most nodes of the BVH are shared by the whole packet)
+template <int TW, int TH>
+void getAlignResults::castImgRayPackets(BVHTree const &bvhtree, math::Vec3f const &origin, std::vector<math::Vec3f> const &rays_dir, std::vector<BVHTree::Hit> &hits)
+{
+    const int N = TW * TH;
+    int tiles_x = (settings.imgW + TW - 1) / TW;
+    int tiles_y = (settings.imgH + TH - 1) / TH;
+    int tiles_total = tiles_x * tiles_y;
+#pragma omp parallel for schedule(dynamic, 16)
+    for ( int tile_index = 0; tile_index < tiles_total; tile_index++ ) {
+        int x0 = (tile_index % tiles_x) * TW;
+        int y0 = (tile_index / tiles_x) * TH;
+        BVHTree::RayPacket<N> packet;
+        size_t lanes_pixel[N];
+        for ( int k = 0; k < N; k++ ) {
+            int x = x0 + k % TW;
+            int y = y0 + k / TW;
+            bool inside = pointValid(x, y);
+            // a lane outside the image keeps a valid direction but never hits (tmax < tmin)
+            lanes_pixel[k] = static_cast<size_t>( inside ? x + y * settings.imgW : x0 + y0 * settings.imgW );
+            math::Vec3f const &dir = rays_dir[lanes_pixel[k]];
+            for ( int d = 0; d < 3; d++ ) {
+                packet.origin[d][k] = origin[d];
+                packet.dir[d][k] = dir[d];
+            }
+            packet.tmin[k] = 0.0f;
+            packet.tmax[k] = inside ? std::numeric_limits<float>::infinity() : -1.0f;
+        }
+        BVHTree::Hit packet_hits[N];
+        bvhtree.intersect(packet, packet_hits);
+        for ( int k = 0; k < N; k++ ) {
+            if ( pointValid(x0 + k % TW, y0 + k / TW) )
+                hits[lanes_pixel[k]] = packet_hits[k];
+        }
+    }
+}
+// rasterize the mesh into a z-buffer to get each pixel's nearest face (instead of casting rays)
+//  the image is split into tiles, every tile keeps the list of faces overlapping it and is rasterized by one thread
+//  the faces crossing the near plane are clipped by it, into 1 or 2 triangles which keep the barycentric coords of the face
+//  hits[].t is the distance along the pixel's ray, so that the results can be shaded as same as the ray casting's
+void getAlignResults::rasterImgValidMesh(size_t img_i, math::Vec3f const &cam_world_v, std::vector<math::Vec3f> const &rays_dir, std::vector<BVHTree::Hit> &hits)
+{
+    const int TILE = 32;
+    const float NEAR_Z = 1e-3f;
+    Camera const & cam = getCamera(img_i);
+
+    // project all vertices to the image plane ( x_img, y_img, z_c ), a block of them at once
+    const int BLOCK = 256;
+    std::vector<math::Vec3f> v_img(point_num);
+#pragma omp parallel
+    {
+        float X[BLOCK], Y[BLOCK], Z[BLOCK], x[BLOCK], y[BLOCK], z[BLOCK];
+#pragma omp for
+        for ( size_t i0 = 0; i0 < point_num; i0 += BLOCK ) {
+            int n = static_cast<int>( EAGLE_MIN(static_cast<size_t>(BLOCK), point_num - i0) );
+            for ( int k = 0; k < n; k++ ) {
+                cv::Vec3f const & p = flatMesh.positions[i0 + k];
+                X[k] = p(0); Y[k] = p(1); Z[k] = p(2);
+            }
+            cam.projectRow(n, X, Y, Z, x, y, z);
+            for ( int k = 0; k < n; k++ )
+                v_img[i0 + k] = math::Vec3f( x[k], y[k], z[k] );
+        }
+    }
 
-    // calc the camera's direction vector (in world coord)
-    cv::Mat cam_v_c = (cv::Mat_<float>(4, 1) << 0, 0, 1, 0);
-    cv::Mat cam_v_w = cameraToWorld(cam_v_c, img_i);
-    math::Vec3f cam_world_v(cam_v_w.at<float>(0), cam_v_w.at<float>(1), cam_v_w.at<float>(2));
-    cam_world_v = cam_world_v.normalized();
+    // the pixels' range [x0, x1] * [y0, y1] of a projected triangle, empty if x0 > x1
+    //  (clamped as floats first, a vertex close to the camera's plane can be projected far away)
+    auto triangle_rect = [this](math::Vec3f const &a, math::Vec3f const &b, math::Vec3f const &c) {
+        float x0 = std::ceil( EAGLE_MIN(a(0), EAGLE_MIN(b(0), c(0))) );
+        float x1 = std::floor( EAGLE_MAX(a(0), EAGLE_MAX(b(0), c(0))) );
+        float y0 = std::ceil( EAGLE_MIN(a(1), EAGLE_MIN(b(1), c(1))) );
+        float y1 = std::floor( EAGLE_MAX(a(1), EAGLE_MAX(b(1), c(1))) );
+        return cv::Vec4i( static_cast<int>( EAGLE_MIN(EAGLE_MAX(x0, 0.0f), static_cast<float>(settings.imgW)) ),
+                          static_cast<int>( EAGLE_MIN(EAGLE_MAX(x1, -1.0f), static_cast<float>(settings.imgW-1)) ),
+                          static_cast<int>( EAGLE_MIN(EAGLE_MAX(y0, 0.0f), static_cast<float>(settings.imgH)) ),
+                          static_cast<int>( EAGLE_MIN(EAGLE_MAX(y1, -1.0f), static_cast<float>(settings.imgH-1)) ) );
+    };
+
+    // put each face into the tiles its bounding box overlaps
+    //  (faces stay in index order in every tile, then the clipped ones, so the depth test always keeps the same face)
+    int tiles_x = (settings.imgW + TILE - 1) / TILE;
+    int tiles_y = (settings.imgH + TILE - 1) / TILE;
+    std::vector<cv::Vec4i> faces_rect(mesh_num); // pixels' range [x0, x1] * [y0, y1], empty if x0 > x1
+    std::vector<uint8_t> faces_crossing(mesh_num, 0);
+#pragma omp parallel for
+    for ( size_t i = 0; i < mesh_num; i++ ) {
+        uint32_t const * face = flatMesh.face(i);
+        math::Vec3f const &a = v_img[ face[0] ];
+        math::Vec3f const &b = v_img[ face[1] ];
+        math::Vec3f const &c = v_img[ face[2] ];
+        faces_rect[i] = cv::Vec4i(1, 0, 1, 0);
+        // faces behind the near plane are not rasterized, the ones crossing it are clipped below
+        int behind = (a(2) <= NEAR_Z) + (b(2) <= NEAR_Z) + (c(2) <= NEAR_Z);
+        if ( behind > 0 ) {
+            faces_crossing[i] = behind < 3;
+            continue;
+        }
+        faces_rect[i] = triangle_rect(a, b, c);
+    }
+
+    // the clipped faces' triangles, each vertex is ( x_img, y_img, z_c ) with its barycentric coords on the face
+    //  (in the tiles' lists, the index of the clipped triangle k is mesh_num + k)
+    struct clipped_triangle {
+        unsigned int face;
+        math::Vec3f v[3], bary[3];
+        cv::Vec4i rect;
+    };
+    std::vector<struct clipped_triangle> clipped;
+    for ( size_t i = 0; i < mesh_num; i++ ) {
+        if ( !faces_crossing[i] )
+            continue;
+        uint32_t const * face = flatMesh.face(i);
+        cv::Vec3f in_p[3], out_p[4];
+        math::Vec3f in_b[3], out_b[4];
+        for ( int k = 0; k < 3; k++ ) {
+            in_p[k] = cam.worldToCamera( flatMesh.positions[face[k]] );
+            in_b[k] = math::Vec3f(k == 0, k == 1, k == 2);
+        }
+        // the polygon of the face in front of the near plane (Sutherland-Hodgman, 3 or 4 vertices)
+        int n = 0;
+        for ( int k = 0; k < 3; k++ ) {
+            int l = (k + 1) % 3;
+            bool k_in = in_p[k](2) > NEAR_Z, l_in = in_p[l](2) > NEAR_Z;
+            if ( k_in ) {
+                out_p[n] = in_p[k];
+                out_b[n++] = in_b[k];
+            }
+            if ( k_in != l_in ) {
+                float t = (NEAR_Z - in_p[k](2)) / (in_p[l](2) - in_p[k](2));
+                for ( int d = 0; d < 2; d++ )
+                    out_p[n](d) = in_p[k](d) + (in_p[l](d) - in_p[k](d)) * t;
+                out_p[n](2) = NEAR_Z;
+                out_b[n++] = in_b[k] + (in_b[l] - in_b[k]) * t;
+            }
+        }
+        for ( int k = 1; k + 1 < n; k++ ) {
+            struct clipped_triangle tri;
+            tri.face = static_cast<unsigned int>(i);
+            int corners[3] = { 0, k, k + 1 };
+            for ( int m = 0; m < 3; m++ ) {
+                cv::Vec3f X_img = cam.cameraToImg( out_p[corners[m]] );
+                tri.v[m] = math::Vec3f( X_img(0), X_img(1), X_img(2) );
+                tri.bary[m] = out_b[corners[m]];
+            }
+            tri.rect = triangle_rect(tri.v[0], tri.v[1], tri.v[2]);
+            clipped.push_back(tri);
+        }
+    }
+
+    std::vector<std::vector<unsigned int>> tiles_faces(static_cast<size_t>(tiles_x * tiles_y));
+    for ( size_t i = 0; i < mesh_num + clipped.size(); i++ ) {
+        cv::Vec4i const &rect = i < mesh_num ? faces_rect[i] : clipped[i - mesh_num].rect;
+        if ( rect(0) > rect(1) || rect(2) > rect(3) )
+            continue;
+        for ( int ty = rect(2) / TILE; ty <= rect(3) / TILE; ty++ )
+            for ( int tx = rect(0) / TILE; tx <= rect(1) / TILE; tx++ )
+                tiles_faces[static_cast<size_t>(tx + ty * tiles_x)].push_back( static_cast<unsigned int>(i) );
+    }
+    static const math::Vec3f face_bary[3] = { math::Vec3f(1, 0, 0), math::Vec3f(0, 1, 0), math::Vec3f(0, 0, 1) };
+
+    // rasterize every tile with its own z-buffer
+    int tiles_total = tiles_x * tiles_y;
+#pragma omp parallel for schedule(dynamic, 1)
+    for ( int tile_index = 0; tile_index < tiles_total; tile_index++ ) {
+        int tx0 = (tile_index % tiles_x) * TILE, tx1 = EAGLE_MIN(tx0 + TILE, settings.imgW) - 1;
+        int ty0 = (tile_index / tiles_x) * TILE, ty1 = EAGLE_MIN(ty0 + TILE, settings.imgH) - 1;
+        float zbuffer[TILE * TILE];
+        for ( int i = 0; i < TILE * TILE; i++ )
+            zbuffer[i] = std::numeric_limits<float>::infinity();
+
+        for ( unsigned int tri_i : tiles_faces[static_cast<size_t>(tile_index)] ) {
+            unsigned int face_i = tri_i;
+            math::Vec3f const *v = nullptr, *bary = face_bary;
+            math::Vec3f face_v[3];
+            cv::Vec4i rect;
+            if ( tri_i < mesh_num ) {
+                uint32_t const * face = flatMesh.face(tri_i);
+                for ( int k = 0; k < 3; k++ )
+                    face_v[k] = v_img[ face[k] ];
+                v = face_v;
+                rect = faces_rect[tri_i];
+            } else {
+                struct clipped_triangle const &tri = clipped[tri_i - mesh_num];
+                face_i = tri.face;
+                v = tri.v;
+                bary = tri.bary;
+                rect = tri.rect;
+            }
+            math::Vec3f const &a = v[0];
+            math::Vec3f const &b = v[1];
+            math::Vec3f const &c = v[2];
+            // 2 * the signed area of the projected face (both sides are visible, as same as the ray casting)
+            float area = (b(0) - a(0)) * (c(1) - a(1)) - (b(1) - a(1)) * (c(0) - a(0));
+            if ( std::fabs(area) < 1e-12f )
+                continue;
+            float inv_area = 1.0f / area;
+            int x0 = EAGLE_MAX(rect(0), tx0), x1 = EAGLE_MIN(rect(1), tx1);
+            int y0 = EAGLE_MAX(rect(2), ty0), y1 = EAGLE_MIN(rect(3), ty1);
+            for ( int y = y0; y <= y1; y++ ) {
+                for ( int x = x0; x <= x1; x++ ) {
+                    // the barycentric coords on the image plane (by the edge functions)
+                    float l0 = ((c(0) - b(0)) * (y - b(1)) - (c(1) - b(1)) * (x - b(0))) * inv_area;
+                    float l1 = ((a(0) - c(0)) * (y - c(1)) - (a(1) - c(1)) * (x - c(0))) * inv_area;
+                    float l2 = 1.0f - l0 - l1;
+                    if ( l0 < 0 || l1 < 0 || l2 < 0 )
+                        continue;
+                    // perspective correct depth and barycentric coords
+                    float w0 = l0 / a(2), w1 = l1 / b(2), w2 = l2 / c(2);
+                    float z = 1.0f / (w0 + w1 + w2);
+                    float &z_buf = zbuffer[(x - tx0) + (y - ty0) * TILE];
+                    if ( z >= z_buf )
+                        continue;
+                    z_buf = z;
+                    size_t pixel_index = static_cast<size_t>(x + y * settings.imgW);
+                    BVHTree::Hit &hit = hits[pixel_index];
+                    hit.idx = face_i;
+                    hit.t = z / cam_world_v.dot(rays_dir[pixel_index]);
+                    hit.bcoords = bary[0] * (w0 * z) + bary[1] * (w1 * z) + bary[2] * (w2 * z);
+                }
+            }
+        }
+    }
+}
+// using the ray intersection method (or the rasterization) to get the pixel's depth
+void getAlignResults::calcImgValidMesh(size_t img_i, BVHTree const *bvhtree)
+{
+    Camera const & cam = getCamera(img_i);
+    // calc the camera's position and direction vector (in world coord)
+    cv::Vec3f cam_p = cam.position(), cam_v = cam.direction();
+    math::Vec3f cam_world_p(cam_p(0), cam_p(1), cam_p(2));
+    math::Vec3f cam_world_v(cam_v(0), cam_v(1), cam_v(2));
+
+    // calc each pixel's ray direction (in world coord), a row at once
+    size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
+    std::vector<math::Vec3f> rays_dir(total);
+#pragma omp parallel
+    {
+        std::vector<float> dir_x(settings.imgW), dir_y(settings.imgW), dir_z(settings.imgW);
+#pragma omp for
+        for ( int y = 0; y < settings.imgH; y++ ) {
+            cam.unprojectRow(0, y, settings.imgW, nullptr, dir_x.data(), dir_y.data(), dir_z.data(), false);
+            for ( int x = 0; x < settings.imgW; x++ ) {
+                math::Vec3f v(dir_x[x], dir_y[x], dir_z[x]);
+                rays_dir[static_cast<size_t>(x + y * settings.imgW)] = v.normalize();
+            }
+        }
+    }
+
+    // find each pixel's nearest face
+    //  by rasterizing the mesh, or by casting the rays from the camera (one by one, or as packets of neighbouring pixels)
+    std::vector<BVHTree::Hit> hits(total);
+    for ( size_t pixel_index = 0; pixel_index < total; pixel_index++)
+        hits[pixel_index].t = std::numeric_limits<float>::infinity();
+    if ( settings.visibilityType == 'z' )
+        rasterImgValidMesh(img_i, cam_world_v, rays_dir, hits);
+    else switch ( settings.rayPacketSize ) {
+    case 4:
+        castImgRayPackets<2, 2>(*bvhtree, cam_world_p, rays_dir, hits);
+        break;
+    case 8:
+        castImgRayPackets<4, 2>(*bvhtree, cam_world_p, rays_dir, hits);
+        break;
+    case 16:
+        castImgRayPackets<4, 4>(*bvhtree, cam_world_p, rays_dir, hits);
+        break;
+    default:
+        castImgRays(*bvhtree, cam_world_p, rays_dir, hits);
+    }
 
     float depth_min = FLT_MAX;
     float depth_max = 0.0;
@@ -422,29 +931,26 @@ void getAlignResults::calcImgValidMesh(size_t img_i, BVHTree &bvhtree)
     float weight_max = 0.0;
     cv::Mat1f depth_f(settings.imgH, settings.imgW, 0.0f);
 
-    size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
-    for ( size_t pixel_index = 0; pixel_index < total; pixel_index++) {
+    // every pixel only writes its own slot, so the hits are shaded in parallel
+    //  (the min/max are reduced per thread, which keeps the results same as the serial loop)
+    struct valid_planes & valid = img_valid_info[img_i];
+    cv::Mat & weight_i = weights[img_i];
+    std::vector<unsigned int> const & order = getPixelOrder();
+#pragma omp parallel for schedule(dynamic, PIXEL_ORDER_CHUNK) reduction(min:depth_min,d2_min,weight_min) reduction(max:depth_max,d2_max,weight_max)
+    for ( size_t k = 0; k < total; k++) {
+        size_t pixel_index = order[k];
         int y = static_cast<int>(pixel_index) / settings.imgW;
         int x = static_cast<int>(pixel_index) % settings.imgW;
-        BVHTree::Ray ray;
-        ray.origin = cam_world_p;
-
-        cv::Mat p_V = imgToWorld(x, y, 1.0, img_i, 0);
-        math::Vec3f v(p_V.at<float>(0), p_V.at<float>(1), p_V.at<float>(2));
-        ray.dir = v.normalize();
-
-        ray.tmin = 0.0f;
-        ray.tmax = std::numeric_limits<float>::infinity();
-
-        BVHTree::Hit hit;
-        if(bvhtree.intersect(ray, &hit)) {
-            struct valid_info * info = &img_valid_info[img_i][pixel_index];
+        math::Vec3f const & ray_dir = rays_dir[pixel_index];
+        BVHTree::Hit const & hit = hits[pixel_index];
+        if( hit.t < std::numeric_limits<float>::infinity() ) {
             // intersection face's id: hit.idx
             // its points ids:  hit.idx * 3 + 0, hit.idx * 3 + 1, hit.idx * 3 + 2
-            info->mesh_id = hit.idx;
+            uint32_t mesh_id = hit.idx;
+            valid.mesh_id[pixel_index] = mesh_id;
 
-            float depth = cam_world_v.dot(hit.t * ray.dir);
-            info->depth = depth;
+            float depth = cam_world_v.dot(hit.t * ray_dir);
+            valid.depth[pixel_index] = depth;
             depth_f.at<float>(y,x) = depth;
             if ( depth < depth_min )
                 depth_min = depth;
@@ -452,14 +958,18 @@ void getAlignResults::calcImgValidMesh(size_t img_i, BVHTree &bvhtree)
                 depth_max = depth;
 
             math::Vec3f const & w = hit.bcoords; // cv::Vec3f( w(0), w(1), w(2) );
-            size_t v1_id = mesh.polygons[info->mesh_id].vertices[0];
-            size_t v2_id = mesh.polygons[info->mesh_id].vertices[1];
-            size_t v3_id = mesh.polygons[info->mesh_id].vertices[2];
+            uint32_t const * face = flatMesh.face(mesh_id);
+            size_t v1_id = face[0];
+            size_t v2_id = face[1];
+            size_t v3_id = face[2];
 
             // calc world position
-            float _x = cloud_rgb.points[v1_id].x * w(0) + cloud_rgb.points[v2_id].x * w(1) + cloud_rgb.points[v3_id].x * w(2);
-            float _y = cloud_rgb.points[v1_id].y * w(0) + cloud_rgb.points[v2_id].y * w(1) + cloud_rgb.points[v3_id].y * w(2);
-            float _z = cloud_rgb.points[v1_id].z * w(0) + cloud_rgb.points[v2_id].z * w(1) + cloud_rgb.points[v3_id].z * w(2);
+            cv::Vec3f const & p1 = flatMesh.positions[v1_id];
+            cv::Vec3f const & p2 = flatMesh.positions[v2_id];
+            cv::Vec3f const & p3 = flatMesh.positions[v3_id];
+            float _x = p1(0) * w(0) + p2(0) * w(1) + p3(0) * w(2);
+            float _y = p1(1) * w(0) + p2(1) * w(1) + p3(1) * w(2);
+            float _z = p1(2) * w(0) + p2(2) * w(1) + p3(2) * w(2);
             float d2 = (cam_world_p(0)-_x)*(cam_world_p(0)-_x) + (cam_world_p(1)-_y)*(cam_world_p(1)-_y) + (cam_world_p(2)-_z)*(cam_world_p(2)-_z);
             if ( d2 < d2_min )
                 d2_min = d2;
@@ -467,20 +977,21 @@ void getAlignResults::calcImgValidMesh(size_t img_i, BVHTree &bvhtree)
                 d2_max = d2;
 
             // calc normal
-            cv::Vec3f n1 = vertex_normal[ v1_id ];
-            cv::Vec3f n2 = vertex_normal[ v2_id ];
-            cv::Vec3f n3 = vertex_normal[ v3_id ];
+            cv::Vec3f const & n1 = flatMesh.normals[ v1_id ];
+            cv::Vec3f const & n2 = flatMesh.normals[ v2_id ];
+            cv::Vec3f const & n3 = flatMesh.normals[ v3_id ];
             math::Vec3f normal;
             normal(0) = n1(0) * w(0) + n2(0) * w(1) + n3(0) * w(2);
             normal(1) = n1(1) * w(0) + n2(1) * w(1) + n3(1) * w(2);
             normal(2) = n1(2) * w(0) + n2(2) * w(1) + n3(2) * w(2);
             normal = normal.normalize();
-            math::Vec3f vert2view = -ray.dir;
+            math::Vec3f vert2view = -ray_dir;
             float cos_alpha = -vert2view.dot(normal); // the cos of angle between camera dir and vertex normal
-            info->cos_alpha = cos_alpha;
+            if ( !valid.cos_alpha.empty() )
+                valid.cos_alpha[pixel_index] = floatToHalf(cos_alpha);
 
             float weight = cos_alpha * cos_alpha / d2;
-            weights[img_i].at<float>(y, x) = weight;
+            weight_i.at<float>(y, x) = weight;
             if ( weight > weight_max )
                 weight_max = weight;
             if ( weight < weight_min && weight > 0 )
@@ -494,11 +1005,11 @@ void getAlignResults::calcImgValidMesh(size_t img_i, BVHTree &bvhtree)
     for ( size_t pixel_index = 0; pixel_index < total; pixel_index++) {
         int y = static_cast<int>(pixel_index) / settings.imgW;
         int x = static_cast<int>(pixel_index) % settings.imgW;
-        weights[img_i].at<float>(y, x) *= d2_min; // normalize the distance
+        weight_i.at<float>(y, x) *= d2_min; // normalize the distance
     }
 
     cv::Mat weight_out;
-    weights[img_i].convertTo(weight_out, CV_8UC1, 255, 0);
+    weight_i.convertTo(weight_out, CV_8UC1, 255, 0);
     cv::imwrite(weightsPath + "/weight_"+std::to_string(img_i)+".png", weight_out);
 }
 
@@ -530,86 +1041,365 @@ void getAlignResults::calcImgValidPatch(size_t img_i)
 }
 int getAlignResults::isPatchValid(size_t img_i, int x, int y)
 {
-    for ( int i = 0; i < settings.patchWidth; i++ ) {
-        if ( weights[img_i].at<float>(y, x + i) > 0 ||
-             weights[img_i].at<float>(y + settings.patchWidth-1, x + i) > 0 )
-            return 1; // valid patch;
-    }
-    for ( int j = 1; j < settings.patchWidth - 1; j++ ) {
-        if ( weights[img_i].at<float>(y + j, x) > 0 ||
-             weights[img_i].at<float>(y + j, x + settings.patchWidth-1) > 0 )
-            return 1; // valid patch;
-    }
-    return 0;
+    // valid if any pixel on the patch's border has a weight
+    return patchKernel.borderValid(weights[img_i].ptr<float>(y) + x, weights[img_i].step, settings.patchWidth);
 }
 
 // for every triangle mesh, do projection from i to j
 void getAlignResults::calcRemapping()
 {
-    //std::map<size_t, std::map<size_t, cv::Mat>> mappings;
     mappings.clear();
-    LOG("[ Image Remapping ]");
+    sampleOwners.clear();
+    // the cameras of this scale are built here, so the correspondences can be found in parallel later
+    for( size_t img_i : kfIndexs)
+        getCamera(img_i);
+    calcCovisibility();
+    LOG( settings.remapOnTheFly ? "[ Image Remapping (on the fly) ]" : "[ Image Remapping ]" );
+    size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
+    for( size_t img_i : kfIndexs)
+        sampleOwners[img_i].assign(total, NO_SAMPLE);
+    // in the order of the slots, a view's pixels are only covered by the samples of the views before it
+    //  (on the fly, only the pixels' samples are kept, their correspondences are found again by findCorrespondences)
     for( size_t img_i : kfIndexs) {
-        mappings[img_i] = std::map<size_t, cv::Mat>();
-        LOG( " " + std::to_string(img_i) + " to ", false );
-        for( size_t img_j : kfIndexs ) {
-            mappings[img_i][img_j] = cv::Mat3i( cv::Size(settings.imgW, settings.imgH) );
-            for( int i = 0; i < settings.imgW; i++ )
-                for( int j = 0; j < settings.imgH; j++ )
-                    mappings[img_i][img_j].at<cv::Vec3i>(j, i) = cv::Vec3i(0,0,0);
-            calcImgRemapping(img_i, img_j);
-            LOG( std::to_string(img_j) + " ", false );
-        }
-        LOG( "<< Done" );
+        LOG( " " + std::to_string(img_i) + " << ", false );
+        size_t samples = calcImgRemapping(img_i, !settings.remapOnTheFly);
+        LOG( std::to_string(samples) + " samples, " + std::to_string(mappings[img_i].entries.size()) + " correspondences << Done" );
     }
     showRemapping();
 }
-// for each pixel in img_i, remapping it to img_j only when the mesh is visible both in i and j
-void getAlignResults::calcImgRemapping(size_t img_i, size_t img_j)
+// find the views which may share some surface with each view, so the other pairs are skipped by the remapping
+//  (a pair is only skipped when it provably can't, see viewsMayOverlap),
+//  and keep only the neighbourViews best ones, ranked by the overlap and the angle between the cameras' directions
+void getAlignResults::calcCovisibility()
 {
-    size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
+    size_t views = kfIndexs.size();
+    // each view's range of depths at this scale
+    std::vector<float> depth_min(views, FLT_MAX), depth_max(views, 0.0f);
 #pragma omp parallel for
-    for ( size_t pixel_index = 0; pixel_index < total; pixel_index++) {
-        // if no depth, then no need to remapping
-        struct valid_info * info = &img_valid_info[img_i][pixel_index];
-        if( info->depth <= 0 )
+    for ( size_t a = 0; a < views; a++ )
+        for ( float depth : img_valid_info[kfIndexs[a]].depth )
+            if ( depth > 0 ) {
+                depth_min[a] = EAGLE_MIN(depth_min[a], depth);
+                depth_max[a] = EAGLE_MAX(depth_max[a], depth);
+            }
+    std::vector<float> score(views * views, 0.0f);
+    std::vector<std::pair<size_t, size_t>> pairs;
+    for ( size_t a = 0; a < views; a++ )
+        for ( size_t b = 0; b < views; b++ )
+            if ( a != b )
+                pairs.push_back( std::make_pair(a, b) );
+#pragma omp parallel for schedule(dynamic, 1)
+    for ( size_t p = 0; p < pairs.size(); p++ ) {
+        size_t a = pairs[p].first, b = pairs[p].second;
+        if ( depth_max[a] <= 0 || depth_max[b] <= 0 || !viewsMayOverlap(kfIndexs[a], kfIndexs[b], depth_min[a], depth_max[a], depth_max[b]) )
             continue;
+        // the sampled overlap only ranks the pairs for neighbourViews, it never skips one
+        float overlap = settings.neighbourViews > 0 ? viewsOverlap(kfIndexs[a], kfIndexs[b]) : 1.0f;
+        float cos_angle = getCamera(kfIndexs[a]).direction().dot( getCamera(kfIndexs[b]).direction() );
+        // a pair facing opposite directions (or without a sampled overlap) still counts, but behind the others
+        score[a * views + b] = (overlap + 1e-3f) * (EAGLE_MAX(cos_angle, 0.0f) + 1e-3f);
+    }
 
-        int y = static_cast<int>(pixel_index) / settings.imgW;
-        int x = static_cast<int>(pixel_index) % settings.imgW;
-        if( img_i == img_j ){
-            mappings[img_i][img_j].at<cv::Vec3i>(y, x)(0) = x;
-            mappings[img_i][img_j].at<cv::Vec3i>(y, x)(1) = y;
-            mappings[img_i][img_j].at<cv::Vec3i>(y, x)(2) = 1;
-            continue;
+    overlapViews.clear();
+    covisibleViews.clear();
+    size_t covisible_pairs = 0;
+    for ( size_t a = 0; a < views; a++ ) {
+        std::vector<uint16_t> neighbours;
+        for ( size_t b = 0; b < views; b++ )
+            if ( score[a * views + b] > 0 || b == a )
+                neighbours.push_back( static_cast<uint16_t>(b) );
+        // every view which may see the view's surface, the samples are projected to them
+        overlapViews[kfIndexs[a]] = neighbours;
+        neighbours.erase(std::find(neighbours.begin(), neighbours.end(), static_cast<uint16_t>(a)));
+        size_t K = settings.neighbourViews;
+        if ( K > 0 && neighbours.size() > K ) {
+            std::stable_sort(neighbours.begin(), neighbours.end(), [&](uint16_t u, uint16_t v) {
+                return score[a * views + u] > score[a * views + v];
+            });
+            neighbours.resize(K);
+        }
+        // itself included, in the order of kfIndexs (so the blending sums in the same order as before)
+        neighbours.push_back( static_cast<uint16_t>(a) );
+        std::sort(neighbours.begin(), neighbours.end());
+        covisible_pairs += neighbours.size() - 1;
+        covisibleViews[kfIndexs[a]] = neighbours;
+    }
+    LOG( " Covisible pairs: " + std::to_string(covisible_pairs) + " / " + std::to_string(pairs.size()) );
+}
+// if a surface point of img_i may be remapped to img_j (false only if it provably can't)
+//  img_i's points are inside its frustum between its depths [depth_min_i, depth_max_i], a convex hull of 8 corners,
+//  and a point passing pointProjectionValid on img_j is inside img_j's frustum (the rounded pixel in the image)
+//  and not farther than img_j's depths (+ the depth test's tolerance), a convex pyramid of 6 planes,
+//  so the pair can't overlap if all the corners are outside one of the planes
+bool getAlignResults::viewsMayOverlap(size_t img_i, size_t img_j, float depth_min_i, float depth_max_i, float depth_max_j)
+{
+    Camera const & cam_i = getCamera(img_i);
+    Camera const & cam_j = getCamera(img_j);
+    float w = static_cast<float>(settings.imgW), h = static_cast<float>(settings.imgH);
+    cv::Vec3f corners[8];
+    for ( int c = 0; c < 8; c++ ) {
+        float x = (c & 1) ? w - 0.5f : -0.5f;
+        float y = (c & 2) ? h - 0.5f : -0.5f;
+        float z = (c & 4) ? depth_max_i : depth_min_i;
+        corners[c] = cam_j.worldToCamera( cam_i.imgToWorld(x, y, z) );
+    }
+    // the planes of img_j's pyramid as a * x_c + b * y_c + c * z_c >= d
+    float planes[6][4] = {
+        { 0, 0, 1, 0 }, // in front of the camera
+        { 0, 0, -1, -(depth_max_j + 0.01f) }, // not farther than the depths
+        { cam_j.fx, 0, cam_j.cx + 0.5f, 0 }, // x_img >= -0.5
+        { -cam_j.fx, 0, w - 0.5f - cam_j.cx, 0 }, // x_img <= imgW - 0.5
+        { 0, cam_j.fy, cam_j.cy + 0.5f, 0 }, // y_img >= -0.5
+        { 0, -cam_j.fy, h - 0.5f - cam_j.cy, 0 } // y_img <= imgH - 0.5
+    };
+    for ( int p = 0; p < 6; p++ ) {
+        bool outside = true;
+        for ( int c = 0; c < 8 && outside; c++ ) {
+            float side = planes[p][0] * corners[c](0) + planes[p][1] * corners[c](1) + planes[p][2] * corners[c](2);
+            // a small margin for the rounding errors of the transforms
+            outside = side < planes[p][3] - 1e-4f * (1.0f + fabsf(planes[p][3]));
         }
+        if ( outside )
+            return false;
+    }
+    return true;
+}
+// the ratio of img_i's sampled pixels (every covisibilityStride pixel in both directions) which can be remapped to img_j,
+//  with a looser depth test than pointProjectionValid's, to rank the neighbour views
+float getAlignResults::viewsOverlap(size_t img_i, size_t img_j)
+{
+    if ( settings.covisibilityStride <= 0 )
+        return 1.0f;
+    int stride = settings.covisibilityStride;
+    Camera const & cam_i = getCamera(img_i);
+    Camera const & cam_j = getCamera(img_j);
+    std::vector<float> const & depth_i = img_valid_info[img_i].depth;
+    std::vector<float> const & depth_j = img_valid_info[img_j].depth;
+    size_t samples = 0, remapped = 0;
+    // a row's sampled points are projected to img_j at once
+    size_t row_samples = static_cast<size_t>( (settings.imgW + stride - 1 - stride / 2) / stride );
+    std::vector<float> X(row_samples), Y(row_samples), Z(row_samples), x_j(row_samples), y_j(row_samples), z_j(row_samples);
+    for ( int y = stride / 2; y < settings.imgH; y += stride ) {
+        int n = 0;
+        for ( int x = stride / 2; x < settings.imgW; x += stride ) {
+            float depth = depth_i[static_cast<size_t>(x + y * settings.imgW)];
+            if ( depth <= 0 )
+                continue;
+            cv::Vec3f p_w = cam_i.imgToWorld(x, y, depth);
+            X[n] = p_w(0); Y[n] = p_w(1); Z[n] = p_w(2);
+            n++;
+        }
+        samples += static_cast<size_t>(n);
+        cam_j.projectRow(n, X.data(), Y.data(), Z.data(), x_j.data(), y_j.data(), z_j.data());
+        for ( int k = 0; k < n; k++ ) {
+            if ( z_j[k] <= 0 )
+                continue;
+            int p_x = static_cast<int>( round(x_j[k]) );
+            int p_y = static_cast<int>( round(y_j[k]) );
+            if ( !pointValid(p_x, p_y) )
+                continue;
+            float depth_x_j = depth_j[static_cast<size_t>(p_x + p_y * settings.imgW)];
+            if ( depth_x_j > 0 && z_j[k] <= depth_x_j + 0.05f )
+                remapped++;
+        }
+    }
+    return samples > 0 ? remapped * 1.0f / samples : 0.0f;
+}
+// the surface samples of img_i: every pixel with a depth which isn't covered by a sample of an earlier view
+//  (in the order of the slots) is a sample, it's unprojected and projected to every view which may see it once (a row at once),
+//  and its correspondences (in the order of kfIndexs, itself included) are stored as the pixel's CSR entries,
+//  then each pixel it's remapped to on a later view takes the sample (the one with the smallest key) instead of its own,
+//  so a surface seen by many views is projected once instead of once from every view, and gives the links of both directions
+//  a sample is only shared (linked to itself and claiming the other views' pixels) if it's valid on img_i as a projection is
+//  (see pointProjectionValid), otherwise every pixel it's remapped to would get the back link to it,
+//  the invalid samples only keep their own links to the other views
+//  the correspondences are only stored if store (otherwise only the samples are found, see findCorrespondences)
+//  return the number of samples of img_i
+size_t getAlignResults::calcImgRemapping(size_t img_i, bool store)
+{
+    size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
+    size_t slot = sampleOwners.slot(img_i);
+    std::vector<uint16_t> const & targets = overlapViews[img_i];
+    std::vector<uint64_t> & owners_i = sampleOwners[img_i];
+    std::vector<float> const & depth_i = img_valid_info[img_i].depth;
+    Camera const & cam_i = getCamera(img_i);
+    int w = settings.imgW;
+
+    // each row appends its samples' correspondences to its own list, then the lists are copied to the CSR
+    std::vector<std::vector<struct correspondence>> row_entries(static_cast<size_t>(settings.imgH));
+    std::vector<uint32_t> counts(total, 0);
+    size_t samples = 0;
+#pragma omp parallel reduction(+:samples)
+    {
+        std::vector<float> X(w), Y(w), Z(w), x_j(w), y_j(w), z_j(w);
+        std::vector<uint8_t> sampled(w), shared(w);
+        std::vector<struct correspondence> found(targets.size() * static_cast<size_t>(w));
+#pragma omp for schedule(dynamic, 1)
+        for ( int y = 0; y < settings.imgH; y++ ) {
+            size_t row = static_cast<size_t>(y * w);
+            size_t row_samples = 0;
+            for ( int x = 0; x < w; x++ ) {
+                // the earlier views' samples are all claimed, and this view's samples only claim the later views' pixels
+                sampled[x] = depth_i[row + x] > 0 && owners_i[row + x] == NO_SAMPLE;
+                shared[x] = sampled[x] && pointProjectionValid(depth_i[row + x], img_i, x, y);
+                if ( sampled[x] ) {
+                    owners_i[row + x] = sampleKey(slot, row + x);
+                    row_samples++;
+                }
+            }
+            if ( row_samples == 0 )
+                continue;
+            samples += row_samples;
+            cam_i.unprojectRow(0, y, w, &depth_i[row], X.data(), Y.data(), Z.data());
+            for ( size_t t = 0; t < targets.size(); t++ ) {
+                struct correspondence *out = &found[t * static_cast<size_t>(w)];
+                size_t img_j = kfIndexs[targets[t]];
+                if ( img_j == img_i ) {
+                    for ( int x = 0; x < w; x++ ) {
+                        out[x] = { targets[t], static_cast<uint16_t>(x), static_cast<uint16_t>(y) };
+                        if ( !shared[x] )
+                            out[x].view = NO_VIEW;
+                    }
+                    continue;
+                }
+                getCamera(img_j).projectRow(w, X.data(), Y.data(), Z.data(), x_j.data(), y_j.data(), z_j.data());
+                std::vector<uint64_t> & owners_j = sampleOwners[img_j];
+                std::vector<float> const & depth_j = img_valid_info[img_j].depth;
+                bool claim = targets[t] > slot;
+                for ( int x = 0; x < w; x++ ) {
+                    out[x].view = NO_VIEW;
+                    if ( !sampled[x] || z_j[x] <= 0 )
+                        continue;
+                    int p_x = static_cast<int>( round(x_j[x]) );
+                    int p_y = static_cast<int>( round(y_j[x]) );
+                    if ( !pointProjectionValid(z_j[x], img_j, p_x, p_y) )
+                        continue;
+                    out[x] = { targets[t], static_cast<uint16_t>(p_x), static_cast<uint16_t>(p_y) };
+                    size_t p_index = static_cast<size_t>(p_x + p_y * w);
+                    if ( claim && shared[x] && depth_j[p_index] > 0 )
+                        claimSample(&owners_j[p_index], sampleKey(slot, row + x));
+                }
+            }
+            if ( !store )
+                continue;
+            std::vector<struct correspondence> & entries = row_entries[static_cast<size_t>(y)];
+            for ( int x = 0; x < w; x++ ) {
+                if ( !sampled[x] )
+                    continue;
+                for ( size_t t = 0; t < targets.size(); t++ ) {
+                    struct correspondence const & Xij = found[t * static_cast<size_t>(w) + static_cast<size_t>(x)];
+                    if ( Xij.view == NO_VIEW )
+                        continue;
+                    entries.push_back(Xij);
+                    counts[row + x]++;
+                }
+            }
+        }
+    }
 
-        cv::Mat p_w = imgToWorld(x, y, info->depth, img_i);
-        cv::Mat p_j = worldToImg(p_w, img_j);
-        cv::Point2i p_img_j;
-        p_img_j.x = static_cast<int>( round(p_j.at<float>(0)) );
-        p_img_j.y = static_cast<int>( round(p_j.at<float>(1)) );
-        if ( !pointProjectionValid(p_j.at<float>(2), img_j, p_img_j.x, p_img_j.y) )
+    if ( !store )
+        return samples;
+    struct correspondence_graph & graph = mappings[img_i];
+    graph.offsets.assign(total + 1, 0);
+    for ( size_t pixel_index = 0; pixel_index < total; pixel_index++)
+        graph.offsets[pixel_index + 1] = graph.offsets[pixel_index] + counts[pixel_index];
+    graph.entries.resize(graph.offsets[total]);
+#pragma omp parallel for
+    for ( int y = 0; y < settings.imgH; y++ ) {
+        std::vector<struct correspondence> & entries = row_entries[static_cast<size_t>(y)];
+        std::copy(entries.begin(), entries.end(), graph.entries.begin() + graph.offsets[static_cast<size_t>(y * w)]);
+        std::vector<struct correspondence>().swap(entries);
+    }
+    return samples;
+}
+// the correspondences of the pixel (x,y) in img_i found again from its sample, for remapOnTheFly
+//  the sample is unprojected and projected as calcImgRemapping does (by the same row functions, for a row of 1 pixel),
+//  so they're the same entries as the stored ones
+//  the correspondences are written to out (kfIndexs.size() slots at most) in the order of kfIndexs, return their number
+//  (the cameras, the overlapping views and the samples of this scale must be found before, see calcRemapping)
+uint32_t getAlignResults::findCorrespondences(size_t img_i, int x, int y, struct correspondence *out)
+{
+    uint64_t key = sampleOwners[img_i][static_cast<size_t>(x + y * settings.imgW)];
+    if ( key == NO_SAMPLE )
+        return 0;
+    size_t img_s = kfIndexs[static_cast<size_t>(key >> 32)];
+    size_t sample_pixel = static_cast<size_t>(key & 0xffffffffu);
+    int x_s = static_cast<int>(sample_pixel) % settings.imgW;
+    int y_s = static_cast<int>(sample_pixel) / settings.imgW;
+    float depth = img_valid_info[img_s].depth[sample_pixel];
+    bool shared = pointProjectionValid(depth, img_s, x_s, y_s);
+
+    float X, Y, Z, x_j, y_j, z_j;
+    getCamera(img_s).unprojectRow(x_s, y_s, 1, &depth, &X, &Y, &Z);
+    uint32_t n = 0;
+    for ( uint16_t v : overlapViews[img_s] ) {
+        size_t img_j = kfIndexs[v];
+        if ( img_j == img_s ) {
+            if ( shared )
+                out[n++] = { v, static_cast<uint16_t>(x_s), static_cast<uint16_t>(y_s) };
             continue;
-
-        mappings[img_i][img_j].at<cv::Vec3i>(y, x)(0) = p_img_j.x;
-        mappings[img_i][img_j].at<cv::Vec3i>(y, x)(1) = p_img_j.y;
-        mappings[img_i][img_j].at<cv::Vec3i>(y, x)(2) = 1;
+        }
+        getCamera(img_j).projectRow(1, &X, &Y, &Z, &x_j, &y_j, &z_j);
+        if ( z_j <= 0 )
+            continue;
+        int p_x = static_cast<int>( round(x_j) );
+        int p_y = static_cast<int>( round(y_j) );
+        if ( !pointProjectionValid(z_j, img_j, p_x, p_y) )
+            continue;
+        out[n++] = { v, static_cast<uint16_t>(p_x), static_cast<uint16_t>(p_y) };
+    }
+    return n;
+}
+// the pixel's correspondences, which are the ones of its sample stored by calcImgRemapping,
+//  or found on the fly (remapOnTheFly) into the calling thread's slots of buf (kfIndexs.size() slots per thread)
+uint32_t getAlignResults::getCorrespondences(size_t img_i, int x, int y, struct correspondence const *&Xs, std::vector<struct correspondence> &buf)
+{
+    struct correspondence *slots = buf.empty() ? nullptr : &buf[static_cast<size_t>(omp_get_thread_num()) * kfIndexs.size()];
+    uint32_t n = 0;
+    if ( settings.remapOnTheFly ) {
+        Xs = slots;
+        n = findCorrespondences(img_i, x, y, slots);
+    } else {
+        uint64_t key = sampleOwners[img_i][static_cast<size_t>(x + y * settings.imgW)];
+        if ( key == NO_SAMPLE )
+            return 0;
+        struct correspondence_graph const & graph = mappings.atSlot(static_cast<size_t>(key >> 32));
+        size_t sample_pixel = static_cast<size_t>(key & 0xffffffffu);
+        Xs = graph.entries.data() + graph.offsets[sample_pixel];
+        n = graph.offsets[sample_pixel + 1] - graph.offsets[sample_pixel];
     }
+    if ( settings.neighbourViews == 0 )
+        return n;
+    // only img_i's neighbour views (both are in the order of kfIndexs, slots may be Xs itself, m <= e)
+    std::vector<uint16_t> const & neighbours = covisibleViews[img_i];
+    uint32_t m = 0;
+    for ( uint32_t e = 0, k = 0; e < n && k < neighbours.size(); ) {
+        if ( Xs[e].view < neighbours[k] ) e++;
+        else if ( Xs[e].view > neighbours[k] ) k++;
+        else { slots[m++] = Xs[e]; e++; k++; }
+    }
+    Xs = slots;
+    return m;
+}
+// the buffer for getCorrespondences, with enough slots for every thread
+std::vector<struct getAlignResults::correspondence> getAlignResults::correspondencesBuffer()
+{
+    if ( !settings.remapOnTheFly && settings.neighbourViews == 0 )
+        return std::vector<struct correspondence>();
+    return std::vector<struct correspondence>(static_cast<size_t>(omp_get_max_threads()) * kfIndexs.size());
 }
 void getAlignResults::showRemapping()
 {
     size_t total = static_cast<size_t>(settings.imgW * settings.imgH);
+    std::vector<struct correspondence> buf = correspondencesBuffer();
     for( size_t img_i : kfIndexs) {
         cv::Mat1d mat( settings.imgH, settings.imgW );
+#pragma omp parallel for
         for ( size_t pixel_index = 0; pixel_index < total; pixel_index++) {
             int y = static_cast<int>(pixel_index) / settings.imgW;
             int x = static_cast<int>(pixel_index) % settings.imgW;
-            mat.at<double>(y, x) = 0;
-            for( size_t img_j : kfIndexs ) {
-                if( mappings[img_i][img_j].at<cv::Vec3i>(y, x)(2) == 1 )
-                    mat.at<double>(y, x) += 1;
-            }
+            struct correspondence const * Xs;
+            mat.at<double>(y, x) = getCorrespondences(img_i, x, y, Xs, buf);
         }
 #pragma omp parallel for
         for ( size_t pixel_index = 0; pixel_index < total; pixel_index++) {
@@ -641,6 +1431,11 @@ void getAlignResults::doIterations()
 
         lamda = settings.lamda;
         patchRandomSearch = settings.patchRandomSearchTimes;
+        // carry the NNFs of the last scale to this one
+        for( size_t i : kfIndexs ) {
+            upsampleNNF(nnf_s2t[i]);
+            upsampleNNF(nnf_t2s[i]);
+        }
 
         char tmp[10]; sprintf(tmp, "%dx%d", settings.imgW, settings.imgH);
         std::string newResolution(tmp);
@@ -672,6 +1467,8 @@ void getAlignResults::doIterations()
             }
         }
 
+        // resample the depth images to the new resolution
+        calcScaleDepths();
         // using ray intersection method to get all pixels' depth and weight
         calcValidMesh();
         // calculate relative patchs to speed up the patchmatch
@@ -739,29 +1536,64 @@ void getAlignResults::doIterations()
 /*----------------------------------------------
  *  PatchMatch
  * ---------------------------------------------*/
+// ann is kept between the iterations (and upsampled between the scales) as the initial guess,
+//  only its distances are re-scored since the images have changed, an empty ann starts from the identity
 void getAlignResults::patchmatch(size_t img_id, cv::Mat3b a, cv::Mat3b b, cv::Mat3i &ann)
 {
     int total = settings.imgH * settings.imgW;
+    bool warm = !ann.empty() && ann.rows == settings.imgH && ann.cols == settings.imgW;
+    if( ! warm )
+        ann.create(settings.imgH, settings.imgW);
+#pragma omp parallel for
+    for ( int index = 0; index < total; index++) {
+        int j = index / settings.imgW;
+        int i = index % settings.imgW;
+        bool in_patch = i < settings.imgW - settings.patchWidth + 1 && j < settings.imgH - settings.patchWidth + 1;
+        if( ! warm || ! in_patch )
+            ann.at<cv::Vec3i>(j, i) = cv::Vec3i(i, j, 0);
+        if( in_patch )
+            ann.at<cv::Vec3i>(j, i)(2) = dist(a, b, i, j, ann.at<cv::Vec3i>(j, i)(0), ann.at<cv::Vec3i>(j, i)(1), INT_MAX);
+    }
+    int sweeps = warm ? settings.patchmatchWarmSweeps : settings.patchmatchColdSweeps;
+    for ( int sweep = 0; sweep < sweeps; sweep++ )
+        patchmatch_iter(img_id, a, b, ann, sweep % 2);
+}
+// map a NNF of the last scale to the current resolution
+//  every patch takes the offset of its nearest patch at the last scale, scaled and clamped into the image
+void getAlignResults::upsampleNNF(cv::Mat3i &ann)
+{
+    if( ann.empty() || (ann.rows == settings.imgH && ann.cols == settings.imgW) )
+        return;
+    cv::Mat3i last = ann;
+    ann = cv::Mat3i(settings.imgH, settings.imgW);
+    int last_ew = last.cols - settings.patchWidth + 1, last_eh = last.rows - settings.patchWidth + 1;
+    int aew = settings.imgW - settings.patchWidth + 1, aeh = settings.imgH - settings.patchWidth + 1;
+    if( last_ew < 1 || last_eh < 1 || aew < 1 || aeh < 1 ) {
+        ann.release(); // no patch to carry, start from the identity
+        return;
+    }
+    double sx = settings.imgW * 1.0 / last.cols, sy = settings.imgH * 1.0 / last.rows;
+    int total = settings.imgH * settings.imgW;
 #pragma omp parallel for
     for ( int index = 0; index < total; index++) {
         int j = index / settings.imgW;
         int i = index % settings.imgW;
-        ann.at<cv::Vec3i>(j, i) = cv::Vec3i(i, j, 0);
-        if( i < settings.imgW - settings.patchWidth + 1 && j < settings.imgH - settings.patchWidth + 1 )
-            ann.at<cv::Vec3i>(j, i)(2) = dist(a, b, i, j, i, j, INT_MAX);
-    }
-    patchmatch_iter(img_id, a, b, ann, 0);
-    patchmatch_iter(img_id, a, b, ann, 1);
-    patchmatch_iter(img_id, a, b, ann, 0);
-    patchmatch_iter(img_id, a, b, ann, 1);
-    patchmatch_iter(img_id, a, b, ann, 0);
-    patchmatch_iter(img_id, a, b, ann, 1);
+        if( i >= aew || j >= aeh ) {
+            ann.at<cv::Vec3i>(j, i) = cv::Vec3i(i, j, 0);
+            continue;
+        }
+        int last_i = EAGLE_MIN(static_cast<int>(i / sx), last_ew - 1);
+        int last_j = EAGLE_MIN(static_cast<int>(j / sy), last_eh - 1);
+        cv::Vec3i const &m = last.at<cv::Vec3i>(last_j, last_i);
+        int x = i + static_cast<int>(std::round((m(0) - last_i) * sx));
+        int y = j + static_cast<int>(std::round((m(1) - last_j) * sy));
+        ann.at<cv::Vec3i>(j, i) = cv::Vec3i(EAGLE_MAX(EAGLE_MIN(x, aew - 1), 0), EAGLE_MAX(EAGLE_MIN(y, aeh - 1), 0), 0);
+    }
 }
 void getAlignResults::patchmatch_iter(size_t img_id, cv::Mat3b a, cv::Mat3b b, cv::Mat3i &ann, int dir)
 {
     int aew = settings.imgW - settings.patchWidth + 1, aeh = settings.imgH - settings.patchWidth + 1;
     int bew = aew, beh = aeh;
-    int total_pm = aew * aeh;
     // Set search window when random searching
     int window_width = static_cast<int>( round(patchRandomSearch * sqrt(settings.imgW * settings.imgH)) );
 
@@ -773,55 +1605,77 @@ void getAlignResults::patchmatch_iter(size_t img_id, cv::Mat3b a, cv::Mat3b b, c
         xchange = 1;
         ychange = 1;
     }
-    srand( static_cast<uint>(time(nullptr)) );
-
-//#pragma omp parallel for
-    for ( int index = 0; index < total_pm; index++) {
-        int ax, ay, bx, by;
-        if(dir == 0) {
-            ay = index / aew;
-            ax = index % aew;
-        } else {
-            ay = aeh-1 - index / aew;
-            ax = aew-1 - index % aew;
-        }
-        // if it's not a valid patch, then continue
-        if (img_valid_patch[img_id].at<int>(ay, ax) == 0)
-            continue;
+    // the random numbers of a patch are the stream of (seed, view, sweep, patch)
+    uint64_t sweep_key = mix64(mix64(mix64(settings.randomSeed) ^ img_id) + patchmatchSweeps++);
+
+    // the patches are split into tiles, each swept in the scanline order as before, coloured as a checkerboard
+    //  a patch only reads the guesses of its left and upper neighbours (right and lower if dir == 1),
+    //  so on a tile's border it only reads the tiles of the other colour, and all the tiles of a colour are swept in parallel,
+    //  the black ones after the red ones (the red tiles take the black ones' guesses of the last sweep)
+    //  the tiles are halved (down to 4) while a colour has less than 2 tiles per thread, to keep the threads busy at the coarse scales
+    int threads = omp_get_max_threads();
+    int tile = EAGLE_MAX(settings.patchTileSize, 1);
+    while ( tile > 4 && ((aew + tile - 1) / tile) * ((aeh + tile - 1) / tile) < 4 * threads )
+        tile /= 2;
+    int tiles_x = (aew + tile - 1) / tile, tiles_y = (aeh + tile - 1) / tile;
+    for ( int colour = 0; colour < 2; colour++ ) {
+#pragma omp parallel for schedule(dynamic, 1)
+        for ( int t = 0; t < tiles_x * tiles_y; t++ ) {
+            int tx = t % tiles_x, tile_y = t / tiles_x;
+            if ( (tx + tile_y) % 2 != colour )
+                continue;
+            int x0 = tx * tile, x1 = EAGLE_MIN(x0 + tile, aew);
+            int y0 = tile_y * tile, y1 = EAGLE_MIN(y0 + tile, aeh);
+            for ( int index = 0; index < (x1 - x0) * (y1 - y0); index++) {
+                int ax, ay, bx, by;
+                if(dir == 0) {
+                    ay = y0 + index / (x1 - x0);
+                    ax = x0 + index % (x1 - x0);
+                } else {
+                    ay = y1-1 - index / (x1 - x0);
+                    ax = x1-1 - index % (x1 - x0);
+                }
+                // if it's not a valid patch, then continue
+                if (img_valid_patch[img_id].at<int>(ay, ax) == 0)
+                    continue;
+                uint64_t patch_key = mix64(sweep_key + static_cast<uint64_t>(ay * aew + ax));
+                uint64_t draws = 0;
+
+                /* Current (best) guess. */
+                int xbest = ann.at<cv::Vec3i>(ay, ax)(0);
+                int ybest = ann.at<cv::Vec3i>(ay, ax)(1);
+                int dbest = ann.at<cv::Vec3i>(ay, ax)(2);
+
+                /* Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). */
+                int ax2 = ax + xchange;
+                if (ax2 > -1 && ax2 < aew) {
+                    bx = ann.at<cv::Vec3i>(ay, ax2)(0) - xchange;
+                    by = ann.at<cv::Vec3i>(ay, ax2)(1);
+                    if (bx > -1 && bx < bew)
+                        improve_guess(a, b, ax, ay, xbest, ybest, dbest, bx, by);
+                }
+                int ay2 = ay + ychange;
+                if (ay2 > -1 && ay2 < aeh) {
+                    bx = ann.at<cv::Vec3i>(ay2, ax)(0);
+                    by = ann.at<cv::Vec3i>(ay2, ax)(1) - ychange;
+                    if (by > -1 && by < beh)
+                        improve_guess(a, b, ax, ay, xbest, ybest, dbest, bx, by);
+                }
 
-        /* Current (best) guess. */
-        int xbest = ann.at<cv::Vec3i>(ay, ax)(0);
-        int ybest = ann.at<cv::Vec3i>(ay, ax)(1);
-        int dbest = ann.at<cv::Vec3i>(ay, ax)(2);
-
-        /* Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). */
-        int ax2 = ax + xchange;
-        if (ax2 > -1 && ax2 < aew) {
-            bx = ann.at<cv::Vec3i>(ay, ax2)(0) - xchange;
-            by = ann.at<cv::Vec3i>(ay, ax2)(1);
-            if (bx > -1 && bx < bew)
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, bx, by);
-        }
-        int ay2 = ay + ychange;
-        if (ay2 > -1 && ay2 < aeh) {
-            bx = ann.at<cv::Vec3i>(ay2, ax)(0);
-            by = ann.at<cv::Vec3i>(ay2, ax)(1) - ychange;
-            if (by > -1 && by < beh)
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, bx, by);
-        }
+                /* Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. */
+                for (int mag = window_width; mag >= 1; mag /= 2) {
+                    int xmin = MAX(xbest-mag, 0), xmax = MIN(xbest+mag+1, bew);
+                    int ymin = MAX(ybest-mag, 0), ymax = MIN(ybest+mag+1, beh);
+                    bx = xmin + static_cast<int>(randomAt(patch_key, draws++) % static_cast<uint32_t>(xmax - xmin));
+                    by = ymin + static_cast<int>(randomAt(patch_key, draws++) % static_cast<uint32_t>(ymax - ymin));
+                    improve_guess(a, b, ax, ay, xbest, ybest, dbest, bx, by);
+                }
 
-        /* Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. */
-        for (int mag = window_width; mag >= 1; mag /= 2) {
-            int xmin = MAX(xbest-mag, 0), xmax = MIN(xbest+mag+1, bew);
-            int ymin = MAX(ybest-mag, 0), ymax = MIN(ybest+mag+1, beh);
-            bx = xmin + rand() % (xmax - xmin);
-            by = ymin + rand() % (ymax - ymin);
-            improve_guess(a, b, ax, ay, xbest, ybest, dbest, bx, by);
+                ann.at<cv::Vec3i>(ay, ax)(0) = xbest;
+                ann.at<cv::Vec3i>(ay, ax)(1) = ybest;
+                ann.at<cv::Vec3i>(ay, ax)(2) = dbest;
+            }
         }
-
-        ann.at<cv::Vec3i>(ay, ax)(0) = xbest;
-        ann.at<cv::Vec3i>(ay, ax)(1) = ybest;
-        ann.at<cv::Vec3i>(ay, ax)(2) = dbest;
     }
 }
 void getAlignResults::improve_guess(cv::Mat3b a, cv::Mat3b b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by)
@@ -835,26 +1689,13 @@ void getAlignResults::improve_guess(cv::Mat3b a, cv::Mat3b b, int ax, int ay, in
 }
 int getAlignResults::dist(cv::Mat3b a, cv::Mat3b b, int ax, int ay, int bx, int by, int cutoff)
 {
-    int ans = 0;
-    for ( int index = 0; index < settings.patchSize; index++) {
-        int j = index / settings.patchWidth;
-        int i = index % settings.patchWidth;
-        cv::Vec3b p_a = a.at<cv::Vec3b>(ay+j, ax+i);
-        cv::Vec3b p_b = b.at<cv::Vec3b>(by+j, bx+i);
-        for(int p_i = 0; p_i < 3; p_i++) {
-            int d = static_cast<int>(p_a(p_i)) - static_cast<int>(p_b(p_i));
-            ans += d * d;
-        }
-        if (ans >= cutoff)
-            return cutoff;
-    }
-    return ans;
+    return patchKernel.ssd(a.ptr<uchar>(ay) + ax * 3, a.step, b.ptr<uchar>(by) + bx * 3, b.step, settings.patchWidth, cutoff);
 }
 
 /*----------------------------------------------
  *  Generate Ti
  * ---------------------------------------------*/
-void getAlignResults::generateTargetI(size_t target_id, std::map<size_t, cv::Mat3b> textures)
+void getAlignResults::generateTargetI(size_t target_id, ViewSlots<cv::Mat3b> const &textures)
 {
     int total = settings.imgH * settings.imgW;
     cv::Mat3b target( cv::Size(settings.imgW, settings.imgH) );
@@ -862,9 +1703,9 @@ void getAlignResults::generateTargetI(size_t target_id, std::map<size_t, cv::Mat
     // patchmatch
     cv::Mat3b sourceImg = sourcesImgs[target_id];
     cv::Mat3b targetImg = cv::imread(targetsFiles[target_id]);
-    cv::Mat3i result_ann_s2t( settings.imgH, settings.imgW ); // cv::Vec3i(x, y, d)
+    cv::Mat3i &result_ann_s2t = nnf_s2t[target_id]; // cv::Vec3i(x, y, d)
     patchmatch(target_id, sourceImg, targetImg, result_ann_s2t);
-    cv::Mat3i result_ann_t2s( settings.imgH, settings.imgW );
+    cv::Mat3i &result_ann_t2s = nnf_t2s[target_id];
     patchmatch(target_id, targetImg, sourceImg, result_ann_t2s);
     cv::Mat4i result_su( cv::Size(settings.imgW, settings.imgH) );
     cv::Mat4i result_sv( cv::Size(settings.imgW, settings.imgH) );
@@ -883,13 +1724,15 @@ void getAlignResults::generateTargetI(size_t target_id, std::map<size_t, cv::Mat
     }
     E1 += (settings.alpha_u * E1_1 + settings.alpha_v * E1_2) / 65025;
 
+    std::vector<struct correspondence> buf = correspondencesBuffer();
 #pragma omp parallel for
     for ( int index = 0; index < total; index++) {
         int j = index / settings.imgW;
         int i = index % settings.imgW;
-        // if the pixel is in bg, then no optimization
-        cv::Vec3i Xij = mappings[target_id][target_id].at<cv::Vec3i>(j, i);
-        if ( Xij(2) == 0 ) {
+        // if the pixel is in bg (no correspondence, not even to itself), then no optimization
+        struct correspondence const * Xs;
+        uint32_t n = getCorrespondences(target_id, i, j, Xs, buf);
+        if ( n == 0 ) {
             target.at<cv::Vec3b>(j, i) = sourcesImgs[target_id].at<cv::Vec3b>(j, i);
             continue;
         }
@@ -910,19 +1753,11 @@ void getAlignResults::generateTargetI(size_t target_id, std::map<size_t, cv::Mat
         double weight = static_cast<double>(weights[target_id].at<float>(j, i));
         double _factor2 = lamda * weight;
         cv::Vec3f sum_M(0,0,0); float sum_w = 0.0f;
-        for( size_t t : kfIndexs ) {
-            if ( t == target_id ) {
-                float w = weights[t].at<float>(j, i);
-                sum_M += textures[t].at<cv::Vec3b>(j, i) * w;
-                sum_w += w;
-            } else {
-                cv::Vec3i Xij = mappings[target_id][t].at<cv::Vec3i>(j, i);
-                if ( Xij(2) > 0 ){
-                    float w = weights[t].at<float>(Xij(1), Xij(0));
-                    sum_M += textures[t].at<cv::Vec3b>(Xij(1), Xij(0)) * w;
-                    sum_w += w;
-                }
-            }
+        for( uint32_t e = 0; e < n; e++ ) {
+            struct correspondence const & Xij = Xs[e];
+            float w = weights.atSlot(Xij.view).at<float>(Xij.y, Xij.x);
+            sum_M += textures.atSlot(Xij.view).at<cv::Vec3b>(Xij.y, Xij.x) * w;
+            sum_w += w;
         }
         sum_bgr += _factor2 * sum_M / sum_w;
 
@@ -939,6 +1774,11 @@ void getAlignResults::generateTargetI(size_t target_id, std::map<size_t, cv::Mat
     } else {
         targetsImgs[target_id] = target;
     }
+    // the NNFs aren't kept for the next iteration
+    if( ! settings.patchmatchWarmStart ) {
+        result_ann_s2t.release();
+        result_ann_t2s.release();
+    }
 }
 bool sortPixelWeight(const struct pixel_weight& a, const struct pixel_weight& b)
 {
@@ -981,6 +1821,11 @@ void getAlignResults::getSimilarityTerm(cv::Mat3b S, cv::Mat3i ann_s2t, cv::Mat3
 }
 void getAlignResults::calcSuv(cv::Mat3b S, int i, int j, cv::Mat4i &s, int x, int y, int w)
 {
+    // a whole patch in both images (as the patches found by patchmatch are)
+    if( w == settings.patchWidth && pointValid(i, j) && pointValid(i+w-1, j+w-1) && pointValid(x, y) && pointValid(x+w-1, y+w-1) ) {
+        patchKernel.accumulate(S.ptr<uchar>(j) + i * 3, S.step, s.ptr<int>(y) + x * 4, s.step, w);
+        return;
+    }
     for ( int dy = 0; dy < w; dy++ ) {
         for ( int dx = 0; dx < w; dx++ ) {
             if( !pointValid( cv::Point2i(x+dx, y+dy) ) || !pointValid( cv::Point2i(i+dx, j+dy) ) )
@@ -996,44 +1841,36 @@ void getAlignResults::calcSuv(cv::Mat3b S, int i, int j, cv::Mat4i &s, int x, in
 /*----------------------------------------------
  *  Generate Mi
  * ---------------------------------------------*/
-void getAlignResults::generateTextureI(size_t texture_id, std::map<size_t, cv::Mat3b> targets)
+void getAlignResults::generateTextureI(size_t texture_id, ViewSlots<cv::Mat3b> const &targets)
 {
     int total = settings.imgH * settings.imgW;
     cv::Mat3b texture( cv::Size(settings.imgW, settings.imgH) );
+    std::vector<struct correspondence> buf = correspondencesBuffer();
 #pragma omp parallel for
     for ( int index = 0; index < total; index++) {
         int j = index / settings.imgW;
         int i = index % settings.imgW;
 
         cv::Vec3f sum(0,0,0);
-        float weight = 0, sum_w = 0;
-        cv::Vec3b pixel; bool flag_valid;
+        float sum_w = 0;
 
         // for E2 calculation
         std::vector<cv::Vec3b> E2_pixels;
         std::vector<float> E2_weights;
 
-        for ( size_t t : kfIndexs ) {
-            flag_valid = true;
-            if ( t == texture_id ) {
-                weight = weights[t].at<float>(j, i);
-                pixel = targets[t].at<cv::Vec3b>(j, i);
-            } else {
-                cv::Vec3i Xij = mappings[texture_id][t].at<cv::Vec3i>(j, i);
-                if ( Xij(2) > 0 ){
-                    weight = weights[t].at<float>(Xij(1), Xij(0));
-                    pixel = targets[t].at<cv::Vec3b>(Xij(1), Xij(0));
-                } else
-                    flag_valid = false;
-            }
-            if(flag_valid == true) {
-                sum_w += weight;
-                for( int p_i = 0; p_i < 3; p_i++ )
-                    sum(p_i) = sum(p_i) + weight * pixel(p_i);
-
-                E2_pixels.push_back(pixel);
-                E2_weights.push_back(weight);
-            }
+        // only the real correspondences (a bg pixel has none, and its weight is 0 anyway)
+        struct correspondence const * Xs;
+        uint32_t n = getCorrespondences(texture_id, i, j, Xs, buf);
+        for ( uint32_t e = 0; e < n; e++ ) {
+            struct correspondence const & Xij = Xs[e];
+            float weight = weights.atSlot(Xij.view).at<float>(Xij.y, Xij.x);
+            cv::Vec3b pixel = targets.atSlot(Xij.view).at<cv::Vec3b>(Xij.y, Xij.x);
+            sum_w += weight;
+            for( int p_i = 0; p_i < 3; p_i++ )
+                sum(p_i) = sum(p_i) + weight * pixel(p_i);
+
+            E2_pixels.push_back(pixel);
+            E2_weights.push_back(weight);
         }
         for( int p_i = 0; p_i < 3; p_i++ )
             texture.at<cv::Vec3b>(j, i)(p_i) = static_cast<uchar>( std::round( sum(p_i) / sum_w ) );
@@ -1069,32 +1906,23 @@ void getAlignResults::generateTextureIWithS(size_t texture_id, std::string fulln
 {
     int total = settings.imgH * settings.imgW;
     cv::Mat3b texture( cv::Size(settings.imgW, settings.imgH) );
+    std::vector<struct correspondence> buf = correspondencesBuffer();
 #pragma omp parallel for
     for ( int index = 0; index < total; index++) {
         int j = index / settings.imgW;
         int i = index % settings.imgW;
 
         cv::Vec3f sum(0,0,0);
-        float weight = 0, sum_w = 0;
-        cv::Vec3b pixel; bool flag_valid;
-        for ( size_t t : kfIndexs ) {
-            flag_valid = true;
-            if ( t == texture_id ) {
-                weight = weights[t].at<float>(j, i);
-                pixel = sourcesImgs[t].at<cv::Vec3b>(j, i);
-            } else {
-                cv::Vec3i Xij = mappings[texture_id][t].at<cv::Vec3i>(j, i);
-                if ( Xij(2) > 0 ){
-                    weight = weights[t].at<float>(Xij(1), Xij(0));
-                    pixel = sourcesImgs[t].at<cv::Vec3b>(Xij(1), Xij(0));
-                } else
-                    flag_valid = false;
-            }
-            if(flag_valid == true) {
-                sum_w += weight;
-                for( int p_i = 0; p_i < 3; p_i++ )
-                    sum(p_i) = sum(p_i) + weight * pixel(p_i);
-            }
+        float sum_w = 0;
+        struct correspondence const * Xs;
+        uint32_t n = getCorrespondences(texture_id, i, j, Xs, buf);
+        for ( uint32_t e = 0; e < n; e++ ) {
+            struct correspondence const & Xij = Xs[e];
+            float weight = weights.atSlot(Xij.view).at<float>(Xij.y, Xij.x);
+            cv::Vec3b pixel = sourcesImgs.atSlot(Xij.view).at<cv::Vec3b>(Xij.y, Xij.x);
+            sum_w += weight;
+            for( int p_i = 0; p_i < 3; p_i++ )
+                sum(p_i) = sum(p_i) + weight * pixel(p_i);
         }
         for( int p_i = 0; p_i < 3; p_i++ )
             texture.at<cv::Vec3b>(j, i)(p_i) = static_cast<uchar>( std::round(sum(p_i) / sum_w) );
@@ -1119,15 +1947,15 @@ void getAlignResults::generateTexturedOBJ(std::string path, std::string filename
 
     // store each vertex's uv index at every image to avoid duplication
     //  img_index => { vertex_index => uv_index }
-    std::map<size_t, std::vector<size_t>> vertex_uv_index;
+    ViewSlots<std::vector<size_t>> vertex_uv_index;
+    vertex_uv_index.init(kfIndexs);
     for( size_t img_i : kfIndexs )
         vertex_uv_index[img_i] = std::vector<size_t>(point_num, 0); // 0 is the invalid index of uv
 
     // store each mesh's info under the mtl
     //  img_index => { mesh_index => [ [point_index, uv_index], [point_index, uv_index], [point_index, uv_index] ] }
-    std::map<size_t, std::vector<struct face_info>> mesh_info;
-    for( size_t img_i : kfIndexs )
-        mesh_info[img_i] = std::vector<struct face_info>();
+    ViewSlots<std::vector<struct face_info>> mesh_info;
+    mesh_info.init(kfIndexs);
 
     std::vector<cv::Point2i> v_uv(3);
     for( size_t i = 0; i < mesh_num; i++ ) {
@@ -1136,11 +1964,10 @@ void getAlignResults::generateTexturedOBJ(std::string path, std::string filename
             v_uv.clear();
             bool flag = true;
             for(size_t p_i = 0; p_i < 3; p_i++){
-                size_t v_index = mesh.polygons[i].vertices[p_i];
-                cv::Mat X_w = (cv::Mat_<float>(4, 1) << cloud_rgb.points[v_index].x, cloud_rgb.points[v_index].y, cloud_rgb.points[v_index].z, 1);
-                cv::Mat X_img = worldToImg(X_w, img_i);
-                cv::Point2i p_img( std::round(X_img.at<float>(0)), std::round(X_img.at<float>(1)) );
-                if( !pointProjectionValid(X_img.at<float>(2), img_i, p_img.x, p_img.y) ||
+                size_t v_index = flatMesh.face(i)[p_i];
+                cv::Vec3f X_img = getCamera(img_i).worldToImg( flatMesh.positions[v_index] );
+                cv::Point2i p_img( std::round(X_img(0)), std::round(X_img(1)) );
+                if( !pointProjectionValid(X_img(2), img_i, p_img.x, p_img.y) ||
                         weights[img_i].at<float>(p_img.y, p_img.x) < 0.1f )
                     flag = false;
                 else {
@@ -1156,7 +1983,7 @@ void getAlignResults::generateTexturedOBJ(std::string path, std::string filename
             // valid mesh, then find its 3 points' uv-coord's index
             struct face_info info;
             for(size_t p_i = 0; p_i < 3; p_i++) {
-                size_t v_index = mesh.polygons[i].vertices[p_i];
+                size_t v_index = flatMesh.face(i)[p_i];
                 // to get its uv-coord index
                 size_t uv_coord_index = 0;
                 // if its uv-coord has been put into the uv_coords
@@ -1180,12 +2007,11 @@ void getAlignResults::generateTexturedOBJ(std::string path, std::string filename
             mesh_info[img_index].push_back( info );
         }
     }
-    saveOBJwithMTL(path, filename, resultImgNamePattern, cloud_rgb, uv_coords, mesh_info);
+    saveOBJwithMTL(path, filename, resultImgNamePattern, uv_coords, mesh_info);
 }
 void getAlignResults::saveOBJwithMTL(std::string path, std::string filename, std::string resultImgNamePattern,
-                                     pcl::PointCloud<pcl::PointXYZRGB> cloud,
                                      std::vector<cv::Point2f> uv_coords,
-                                     std::map<size_t, std::vector<struct face_info>> mesh_info)
+                                     ViewSlots<std::vector<struct face_info>> const &mesh_info)
 {
     std::ofstream out;
     char tmp[32]; std::string img_filename;
@@ -1209,10 +2035,10 @@ void getAlignResults::saveOBJwithMTL(std::string path, std::string filename, std
     out.open ( path + "/" + filename + ".obj" );
     out << "mtllib " << filename + ".mtl" << std::endl;
     //  output vertices
-    for (size_t i = 0; i < cloud.size(); ++i) {
-        out << "v " << cloud.points[i].x << " "
-            << cloud.points[i].y << " "
-            << cloud.points[i].z << std::endl;
+    for (size_t i = 0; i < flatMesh.positions.size(); ++i) {
+        out << "v " << flatMesh.positions[i](0) << " "
+            << flatMesh.positions[i](1) << " "
+            << flatMesh.positions[i](2) << std::endl;
     }
     //  output uv-coords // discard the first invalid coord
     for (size_t i = 1; i < uv_coords.size(); ++i) {
@@ -1220,10 +2046,10 @@ void getAlignResults::saveOBJwithMTL(std::string path, std::string filename, std
             << 1.0f - uv_coords[i].y << std::endl;
     }
     //  output normals
-    for (size_t i = 0; i < vertex_normal.size(); ++i) {
-        out << "vn " << vertex_normal[i](0) << " "
-            << vertex_normal[i](1) << " "
-            << vertex_normal[i](2) << std::endl;
+    for (size_t i = 0; i < flatMesh.normals.size(); ++i) {
+        out << "vn " << flatMesh.normals[i](0) << " "
+            << flatMesh.normals[i](1) << " "
+            << flatMesh.normals[i](2) << std::endl;
     }
     //  output faces
     for ( size_t i : kfIndexs ) {
@@ -1232,7 +2058,7 @@ void getAlignResults::saveOBJwithMTL(std::string path, std::string filename, std
         sprintf(tmp, resultImgNamePattern.c_str(), i); img_filename = tmp;
         out << "usemtl " << img_filename << std::endl;
         for (std::size_t j = 0; j < mesh_info[i].size(); ++j) {
-            struct face_info * info = &mesh_info[i][j];
+            struct face_info const * info = &mesh_info[i][j];
             out << "f";
             for (std::size_t k = 0; k < 3; ++k) {
                 out << " " << info->v_index[k] + 1 // start from 1
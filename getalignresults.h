@@ -6,6 +6,7 @@
 #include <vector>
 #include <omp.h>
 #include <cfloat>
+#include <cstring>
 #include <ctime>
 
 #include <opencv2/opencv.hpp>
@@ -20,6 +21,10 @@
 #include <acc/bvh_tree.h>
 
 #include "settings.h"
+#include "camera.h"
+#include "viewslots.h"
+#include "flatmesh.h"
+#include "patchkernels.h"
 #include "Eagle_Utils.h"
 
 class getAlignResults
@@ -32,7 +37,7 @@ public:
     pcl::PolygonMesh mesh;
     pcl::PointCloud<pcl::PointXYZRGB> cloud_rgb;
     size_t point_num, mesh_num;
-    std::vector<cv::Vec3f> vertex_normal;
+    FlatMesh flatMesh; // the mesh (with the vertices' normals) read by all geometry stages
 
     std::string processPath, resultsPath;
     std::string sourcesPath, targetsPath, texturesPath, weightsPath;
@@ -40,20 +45,41 @@ public:
     size_t kfStart, kfTotal;
     std::vector<size_t> kfIndexs;
     std::vector<cv::String> sourcesOrigin; // all sources' full path (with filename and ext)
-    std::map<size_t, cv::String> sourcesFiles, targetsFiles, texturesFiles;
-    std::map<size_t, cv::Mat3b> sourcesImgs, targetsImgs, texturesImgs;
-    std::map<size_t, cv::Mat> depthImgs;
+    // the per-view data below are stored by the views' slots in kfIndexs (see initViewSlots)
+    ViewSlots<cv::String> sourcesFiles, targetsFiles, texturesFiles;
+    ViewSlots<cv::Mat3b> sourcesImgs, targetsImgs, texturesImgs;
+    ViewSlots<cv::Mat> depthImgs;
+    ViewSlots<cv::Mat1f> scaleDepthImgs; // the depth images at the current resolution (in metres)
 
-    struct valid_info // a pixel's valid info of the mesh
+    struct valid_planes // all pixels' valid info of the mesh, as planes indexed by pixel_index
     {
-        float depth = 0; // 0m ~ 1m
-        float cos_alpha = 0;
-        size_t mesh_id = 0;
+        std::vector<float> depth; // 0m ~ 1m, 0 if no mesh is visible
+        std::vector<uint32_t> mesh_id;
+        std::vector<uint16_t> cos_alpha; // as half floats, only kept with settings.validCosAlpha
+        bool empty() const { return depth.empty(); }
+        void reset(size_t total, bool with_cos_alpha)
+        {
+            depth.assign(total, 0.0f);
+            mesh_id.assign(total, 0);
+            cos_alpha.assign(with_cos_alpha ? total : 0, 0);
+        }
     };
-    std::map<size_t, std::vector<struct valid_info>> img_valid_info;
-    std::map<size_t, cv::Mat> weights;
-    std::map<size_t, cv::Mat> img_valid_patch;
-    std::map<size_t, std::map<size_t, cv::Mat>> mappings;
+    ViewSlots<struct valid_planes> img_valid_info;
+    ViewSlots<cv::Mat> weights;
+    ViewSlots<struct valid_planes> origin_valid_info; // at the origin resolution (validMeshFromOrigin)
+    ViewSlots<cv::Mat> origin_weights;
+    ViewSlots<cv::Mat> img_valid_patch;
+    struct correspondence // a pixel's corresponding pixel (x, y) on the (kfIndexs[view])th image
+    {
+        uint16_t view, x, y;
+    };
+    struct correspondence_graph // all pixels' correspondences of an image, as CSR
+    {
+        std::vector<uint32_t> offsets; // pixel_index => its entries are [offsets[pixel_index], offsets[pixel_index+1])
+        std::vector<struct correspondence> entries;
+    };
+    ViewSlots<struct correspondence_graph> mappings; // img_i => its samples' correspondences (see calcImgRemapping)
+    ViewSlots<std::vector<uint64_t>> sampleOwners; // img_i => pixel_index => the key of the sample the pixel takes the correspondences of
 
     double scaleF;
     double lamda, patchRandomSearch;
@@ -61,50 +87,73 @@ public:
 
     getAlignResults(Settings &_settings);
     ~getAlignResults();
+    void initViewSlots();
     void LOG(std::string t, bool nl = true);
 
     std::string getImgFilename(size_t img_i);
     std::string getImgFilename(size_t img_i, std::string pre, std::string ext);
 
     void readDepthImgs();
+    void calcScaleDepths();
     float getDepth(size_t img_i, int x, int y);
 
     void readCameraTraj(std::string camTraj_file);
     void readCameraTraj();
-    cv::Mat cameraToWorld(cv::Mat X_c, size_t id);
-    cv::Mat worldToCamera(cv::Mat X_w, size_t id);
-    cv::Mat imgToCamera(int x, int y, float z);
-    cv::Mat cameraToImg(cv::Mat X_c);
-    cv::Mat imgToWorld(int x, int y, float z, size_t id, int is_point = 1);
-    cv::Mat worldToImg(cv::Mat X_w, size_t id);
+    std::vector<Camera> cameras; // every key frame's camera at the scale camerasScaleF
+    double camerasScaleF = 0;
+    Camera const & getCamera(size_t id);
     bool pointValid(int x, int y);
     bool pointValid(cv::Point2i p_img);
     bool pointValid(cv::Point2f p_img);
     bool pointProjectionValid(float point_z, size_t img_id, int x, int y);
+    std::vector<unsigned int> pixelOrder; // pixel_index in the tiled Z-order, for the resolution pixelOrderW * pixelOrderH
+    int pixelOrderW = 0, pixelOrderH = 0;
+    std::vector<unsigned int> const & getPixelOrder();
 
     void calcNormals();
-    void calcValidMesh();
     typedef acc::BVHTree<unsigned int, math::Vec3f> BVHTree;
-    void calcImgValidMesh(size_t img_i, BVHTree &bvhtree);
+    BVHTree::Ptr meshBVH;
+    void initScene();
+    BVHTree const & getMeshBVH();
+    void calcValidMesh();
+    void calcValidMeshFromOrigin();
+    void calcImgValidMeshFromOrigin(size_t img_i);
+    void calcImgValidMesh(size_t img_i, BVHTree const *bvhtree);
+    void castImgRays(BVHTree const &bvhtree, math::Vec3f const &origin, std::vector<math::Vec3f> const &rays_dir, std::vector<BVHTree::Hit> &hits);
+    template <int TW, int TH>
+    void castImgRayPackets(BVHTree const &bvhtree, math::Vec3f const &origin, std::vector<math::Vec3f> const &rays_dir, std::vector<BVHTree::Hit> &hits);
+    void rasterImgValidMesh(size_t img_i, math::Vec3f const &cam_world_v, std::vector<math::Vec3f> const &rays_dir, std::vector<BVHTree::Hit> &hits);
     void calcValidPatch();
     void calcImgValidPatch(size_t img_i);
     int isPatchValid(size_t img_i, int x, int y);
     void calcRemapping();
-    void calcImgRemapping(size_t img_i, size_t img_j);
+    ViewSlots<std::vector<uint16_t>> overlapViews; // img_i => the indexes in kfIndexs of the views which may see its surface (itself included)
+    ViewSlots<std::vector<uint16_t>> covisibleViews; // img_i => the indexes in kfIndexs of its best neighbour views (itself included)
+    ViewSlots<cv::Mat3i> nnf_s2t, nnf_t2s; // img_i => the NNFs from Si to Ti and from Ti to Si, warm-started by patchmatch
+    void calcCovisibility();
+    bool viewsMayOverlap(size_t img_i, size_t img_j, float depth_min_i, float depth_max_i, float depth_max_j);
+    float viewsOverlap(size_t img_i, size_t img_j);
+    size_t calcImgRemapping(size_t img_i, bool store = true);
+    uint32_t findCorrespondences(size_t img_i, int x, int y, struct correspondence *out);
+    uint32_t getCorrespondences(size_t img_i, int x, int y, struct correspondence const *&Xs, std::vector<struct correspondence> &buf);
+    std::vector<struct correspondence> correspondencesBuffer();
     void showRemapping();
 
     void doIterations();
 
     void patchmatch(size_t img_id, cv::Mat3b a, cv::Mat3b b, cv::Mat3i &ann);
+    void upsampleNNF(cv::Mat3i &ann);
     void patchmatch_iter(size_t img_id, cv::Mat3b a, cv::Mat3b b, cv::Mat3i &ann, int dir);
     void improve_guess(cv::Mat3b a, cv::Mat3b b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by);
     int dist(cv::Mat3b a, cv::Mat3b b, int ax, int ay, int bx, int by, int cutoff=INT_MAX);
+    PatchKernels patchKernel; // the patch kernels picked for the patch width and the CPU
+    uint64_t patchmatchSweeps; // the number of sweeps done, a part of the random search's key
 
-    void generateTargetI(size_t target_id, std::map<size_t, cv::Mat3b> textures);
+    void generateTargetI(size_t target_id, ViewSlots<cv::Mat3b> const &textures);
     void getSimilarityTerm(cv::Mat3b S, cv::Mat3i ann_s2t, cv::Mat3i ann_t2s, cv::Mat4i &su, cv::Mat4i &sv);
     void calcSuv(cv::Mat3b S, int i, int j, cv::Mat4i &s, int x, int y, int w);
 
-    void generateTextureI(size_t texture_id, std::map<size_t, cv::Mat3b> targets);
+    void generateTextureI(size_t texture_id, ViewSlots<cv::Mat3b> const &targets);
     void generateTextureIWithS(size_t texture_id, std::string fullname);
 
     struct face_info
@@ -114,7 +163,7 @@ public:
         std::vector<size_t> n_index = std::vector<size_t>(3);
     };
     void generateTexturedOBJ(std::string path, std::string filename, std::string resultImgNamePattern);
-    void saveOBJwithMTL(std::string path, std::string filename, std::string resultImgNamePattern, pcl::PointCloud<pcl::PointXYZRGB> cloud, std::vector<cv::Point2f> uv_coords, std::map<size_t, std::vector<struct face_info>> mesh_info);
+    void saveOBJwithMTL(std::string path, std::string filename, std::string resultImgNamePattern, std::vector<cv::Point2f> uv_coords, ViewSlots<std::vector<struct face_info>> const &mesh_info);
 };
 
 struct pixel_weight {
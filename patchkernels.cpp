@@ -0,0 +1,212 @@
+#include "patchkernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PATCH_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// every kernel is a template of the patch's width W, so the patch loops of the common widths are fully unrolled,
+//  W == 0 is the generic instance which reads the width from the argument
+#define PATCH_WIDTH (W ? W : width)
+
+/*----------------------------------------------
+ *  Scalar
+ * ---------------------------------------------*/
+template <int W>
+static int patchSSDScalarW(const uint8_t *a, size_t a_step, const uint8_t *b, size_t b_step, int width, int cutoff)
+{
+    int ans = 0, row_bytes = PATCH_WIDTH * 3;
+    for ( int j = 0; j < PATCH_WIDTH; j++, a += a_step, b += b_step ) {
+        for ( int k = 0; k < row_bytes; k++ ) {
+            int d = static_cast<int>(a[k]) - static_cast<int>(b[k]);
+            ans += d * d;
+        }
+        if (ans >= cutoff)
+            return cutoff;
+    }
+    return ans;
+}
+int patchSSDScalar(const uint8_t *a, size_t a_step, const uint8_t *b, size_t b_step, int width, int cutoff)
+{
+    return patchSSDScalarW<0>(a, a_step, b, b_step, width, cutoff);
+}
+
+#ifdef PATCH_KERNELS_X86
+/*----------------------------------------------
+ *  SSE2 / AVX2
+ *   |a-b| of the bytes by the saturated subtractions, widened to 16 bits and squared and summed in pairs by pmaddwd
+ *   (pmaddubsw can't be used for the squares, it takes one of the operands as signed bytes)
+ *   a row's bytes which don't fill a register are loaded by a register ending at the row's end,
+ *   with the lanes already summed masked out, so nothing out of the patch is read
+ * ---------------------------------------------*/
+// tail_mask + 32 - skip: the first skip lanes are 0, the others are 0xff
+static const uint8_t tail_mask[64] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+__attribute__((target("sse2"))) static inline __m128i sqrDiff16(__m128i a, __m128i b, __m128i mask, __m128i acc)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i d = _mm_and_si128(_mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a)), mask);
+    __m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+    return _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+}
+__attribute__((target("sse2"))) static inline int hsum128(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+// the bytes [k, n) of a row
+__attribute__((target("sse2"))) static inline __m128i sqrDiffRow16(const uint8_t *a, const uint8_t *b, int k, int n, __m128i acc)
+{
+    __m128i all = _mm_set1_epi8(static_cast<char>(0xff));
+    for ( ; k + 16 <= n; k += 16 )
+        acc = sqrDiff16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + k)),
+                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + k)), all, acc);
+    if ( k == n )
+        return acc;
+    if ( n >= 16 ) {
+        __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tail_mask + 32 - (16 - (n - k))));
+        return sqrDiff16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + n - 16)),
+                         _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + n - 16)), mask, acc);
+    }
+    // a short row (the patch is narrower than 6 pixels), by 8 bytes
+    for ( ; k + 8 <= n; k += 8 )
+        acc = sqrDiff16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + k)),
+                        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b + k)), all, acc);
+    if ( k == n )
+        return acc;
+    if ( n >= 8 ) {
+        __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tail_mask + 32 - (8 - (n - k))));
+        return sqrDiff16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + n - 8)),
+                         _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b + n - 8)), mask, acc);
+    }
+    int rest = 0;
+    for ( ; k < n; k++ ) {
+        int d = static_cast<int>(a[k]) - static_cast<int>(b[k]);
+        rest += d * d;
+    }
+    return _mm_add_epi32(acc, _mm_cvtsi32_si128(rest));
+}
+
+template <int W>
+__attribute__((target("sse2"))) static int patchSSDSSE2W(const uint8_t *a, size_t a_step, const uint8_t *b, size_t b_step, int width, int cutoff)
+{
+    int ans = 0, row_bytes = PATCH_WIDTH * 3;
+    for ( int j = 0; j < PATCH_WIDTH; j++, a += a_step, b += b_step ) {
+        ans += hsum128(sqrDiffRow16(a, b, 0, row_bytes, _mm_setzero_si128()));
+        if (ans >= cutoff)
+            return cutoff;
+    }
+    return ans;
+}
+
+__attribute__((target("avx2"))) static inline __m256i sqrDiff32(__m256i a, __m256i b, __m256i mask, __m256i acc)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i d = _mm256_and_si256(_mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a)), mask);
+    __m256i lo = _mm256_unpacklo_epi8(d, zero), hi = _mm256_unpackhi_epi8(d, zero);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+}
+
+template <int W>
+__attribute__((target("avx2"))) static int patchSSDAVX2W(const uint8_t *a, size_t a_step, const uint8_t *b, size_t b_step, int width, int cutoff)
+{
+    int ans = 0, row_bytes = PATCH_WIDTH * 3;
+    __m256i all = _mm256_set1_epi8(static_cast<char>(0xff));
+    for ( int j = 0; j < PATCH_WIDTH; j++, a += a_step, b += b_step ) {
+        __m256i acc = _mm256_setzero_si256();
+        int k = 0;
+        for ( ; k + 32 <= row_bytes; k += 32 )
+            acc = sqrDiff32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + k)),
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + k)), all, acc);
+        __m128i acc_128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        if ( k < row_bytes && row_bytes >= 32 ) {
+            __m256i mask = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tail_mask + 32 - (32 - (row_bytes - k))));
+            acc = sqrDiff32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + row_bytes - 32)),
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + row_bytes - 32)), mask, _mm256_setzero_si256());
+            acc_128 = _mm_add_epi32(acc_128, _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+        } else if ( k < row_bytes ) // less than 32 bytes in a row (the patch is narrower than 11 pixels)
+            acc_128 = sqrDiffRow16(a, b, k, row_bytes, acc_128);
+        ans += hsum128(acc_128);
+        if (ans >= cutoff)
+            return cutoff;
+    }
+    return ans;
+}
+#endif // PATCH_KERNELS_X86
+
+/*----------------------------------------------
+ *  Voting and Valid Patches
+ * ---------------------------------------------*/
+template <int W>
+static void patchAccumulateW(const uint8_t *src, size_t src_step, int *dst, size_t dst_step, int width)
+{
+    for ( int dy = 0; dy < PATCH_WIDTH; dy++ ) {
+        const uint8_t *src_row = src + dy * src_step;
+        int *dst_row = reinterpret_cast<int *>(reinterpret_cast<uint8_t *>(dst) + dy * dst_step);
+        for ( int dx = 0; dx < PATCH_WIDTH; dx++ ) {
+            dst_row[dx * 4 + 0] += src_row[dx * 3 + 0];
+            dst_row[dx * 4 + 1] += src_row[dx * 3 + 1];
+            dst_row[dx * 4 + 2] += src_row[dx * 3 + 2];
+            dst_row[dx * 4 + 3] += 1;
+        }
+    }
+}
+template <int W>
+static int patchBorderValidW(const float *weights, size_t step, int width)
+{
+    const float *top = weights;
+    const float *bottom = reinterpret_cast<const float *>(reinterpret_cast<const uint8_t *>(weights) + (PATCH_WIDTH - 1) * step);
+    for ( int i = 0; i < PATCH_WIDTH; i++ ) {
+        if ( top[i] > 0 || bottom[i] > 0 )
+            return 1;
+    }
+    for ( int j = 1; j < PATCH_WIDTH - 1; j++ ) {
+        const float *row = reinterpret_cast<const float *>(reinterpret_cast<const uint8_t *>(weights) + j * step);
+        if ( row[0] > 0 || row[PATCH_WIDTH - 1] > 0 )
+            return 1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------
+ *  Dispatch
+ * ---------------------------------------------*/
+template <int W>
+static PatchKernels selectPatchKernels(int width)
+{
+    PatchKernels kernels;
+    kernels.width = width;
+    kernels.unrolled = W != 0;
+    kernels.ssdName = "scalar";
+    kernels.ssd = patchSSDScalarW<W>;
+#ifdef PATCH_KERNELS_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) {
+        kernels.ssdName = "avx2";
+        kernels.ssd = patchSSDAVX2W<W>;
+    } else if ( __builtin_cpu_supports("sse2") ) {
+        kernels.ssdName = "sse2";
+        kernels.ssd = patchSSDSSE2W<W>;
+    }
+#endif
+    kernels.accumulate = patchAccumulateW<W>;
+    kernels.borderValid = patchBorderValidW<W>;
+    return kernels;
+}
+PatchKernels patchKernels(int width)
+{
+    switch ( width ) {
+    case 5: return selectPatchKernels<5>(width);
+    case 7: return selectPatchKernels<7>(width);
+    case 9: return selectPatchKernels<9>(width);
+    case 11: return selectPatchKernels<11>(width);
+    default: return selectPatchKernels<0>(width);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef PATCHKERNELS_H
+#define PATCHKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// the SSD of two width x width patches of 8-bit BGR images
+//  a and b point to the patches' left-up pixels, a_step and b_step are the images' row steps in bytes
+//  once the sum reaches the cutoff it stops (at the end of a row) and returns the cutoff,
+//  which is the same result as checking after every pixel, since the sum never decreases
+typedef int (*PatchSSDFunc)(const uint8_t *a, size_t a_step, const uint8_t *b, size_t b_step, int width, int cutoff);
+
+// the plain C++ kernel, used when the CPU has no faster one
+int patchSSDScalar(const uint8_t *a, size_t a_step, const uint8_t *b, size_t b_step, int width, int cutoff);
+
+// add a width x width patch of an 8-bit BGR image to the voting sums (cv::Vec4i: the sums of B, G, R and the count)
+//  src and dst point to the patches' left-up pixels, the steps are in bytes
+typedef void (*PatchAccumulateFunc)(const uint8_t *src, size_t src_step, int *dst, size_t dst_step, int width);
+// if any pixel on the border of a width x width patch of the weights is > 0
+typedef int (*PatchBorderValidFunc)(const float *weights, size_t step, int width);
+
+// the kernels of one patch width, picked once (the width doesn't change in a run)
+//  the widths 5, 7, 9 and 11 have their own instances with the patch loops fully unrolled,
+//  the other widths use the generic ones, and the SSD kernel is the fastest the CPU supports (AVX2, SSE2 or scalar)
+struct PatchKernels
+{
+    int width;
+    bool unrolled; // if it's an instance of the width
+    const char *ssdName;
+    PatchSSDFunc ssd;
+    PatchAccumulateFunc accumulate;
+    PatchBorderValidFunc borderValid;
+};
+PatchKernels patchKernels(int width);
+
+#endif // PATCHKERNELS_H
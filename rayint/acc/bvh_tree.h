@@ -11,12 +11,27 @@
 
 #include <array>
 #include <deque>
+#include <memory>
+#include <vector>
 #include <stack>
 #include <cassert>
 #include <algorithm>
 #include <atomic>
 #include <thread>
 #include <limits>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <tuple>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "primitives.h"
 
@@ -31,6 +46,7 @@ public:
     typedef std::shared_ptr<const BVHTree<IdxType, Vec3fType> > ConstPtr;
 
     typedef acc::Ray<Vec3fType> Ray;
+    template <int N> using RayPacket = acc::RayPacket<N>;
     struct Hit {
         /* Parameter of the ray (distance of hit location). */
         float t;
@@ -55,14 +71,44 @@ private:
         AABB aabb;
     };
 
+    /* Node of the tree flattened in depth first order, which is traversed
+     * after the construction (32 bytes for 32 bit indices): an inner node's
+     * left child directly follows it and second is the right child's index,
+     * a leaf has num > 0 triangles starting at second. */
+    struct FlatNode {
+        AABB aabb;
+        IdxType second;
+        IdxType num;
+    };
+
+    /* Node of the 4-wide tree collapsed from the flat one (see build_wide4),
+     * the children's bounds are stored as SoA to be tested at once (128 bytes
+     * for 32 bit indices). An inner child is the index of its wide node with
+     * num 0, a leaf child is the range of num > 0 triangles starting at child,
+     * an empty slot has child NAI. */
+    struct WideNode {
+        float bounds[6][4];
+        IdxType child[4];
+        IdxType num[4];
+    };
+
+    /* Size of the traversal stack kept on the call stack, the construction
+     * makes a node a leaf at this depth, so the tree is never deeper. */
+    static constexpr int STACK_SIZE = 128;
+
     struct Bin {
         IdxType n;
         AABB aabb;
     };
 
     std::vector<IdxType> indices;
-    std::vector<Tri> tris;
+    /* Precomputed in the order of indices, so a leaf's triangles are contiguous. */
+    std::vector<TriAccel> tris;
 
+    std::vector<FlatNode> flat_nodes;
+    std::vector<WideNode> wide_nodes;
+
+    /* Nodes used during the construction only. */
     std::atomic<IdxType> num_nodes;
     std::vector<Node> nodes;
     typename Node::ID create_node(IdxType first, IdxType last)
@@ -85,9 +131,31 @@ private:
     std::pair<typename Node::ID, typename Node::ID> ssplit(typename Node::ID node_id,
         std::vector<AABB> const & aabbs);
     void split(typename Node::ID, std::vector<AABB> const & aabbs,
-        std::atomic<int> * num_threads);
+        std::atomic<int> * num_threads, int depth);
+    void flatten(void);
+
+    /* Header of the files written by save(). */
+    struct FileHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t idx_size;
+        std::uint64_t key;
+        std::uint64_t num_nodes;
+        std::uint64_t num_tris;
+    };
+    static constexpr std::uint32_t FILE_VERSION = 1;
 
-    bool intersect(Ray const & ray, typename Node::ID node_id, Hit * hit) const;
+    BVHTree() : num_nodes(0) {}
+    bool read(char const * data, std::size_t size, std::uint64_t key);
+    bool valid(void) const;
+
+    bool intersect(Ray const & ray, FlatNode const & leaf, Hit * hit) const;
+    bool intersect(Ray const & ray, IdxType first, IdxType num, Hit * hit) const;
+    static unsigned int intersect_children(Ray const & ray, float const * inv_dir,
+        WideNode const & node, float * tmin_ptr);
+    bool intersect_wide(Ray ray, Hit * hit_ptr) const;
+    template <int N>
+    unsigned int intersect(RayPacket<N> & packet, FlatNode const & leaf, Hit * hits) const;
 
 public:
     static
@@ -100,6 +168,15 @@ public:
     template <class C>
     static C convert(BVHTree const & bvh_tree);
 
+    /* Writes the built tree (nodes, reordered indices and triangles) to
+     * the file, key identifies the mesh (e.g. a hash of its buffers). */
+    bool save(std::string const & filename, std::uint64_t key) const;
+
+    /* Loads a tree written by save() by memory mapping the file.
+     * Returns a null pointer if the file is missing, broken or was
+     * written with another key, index type or format version. */
+    static Ptr load(std::string const & filename, std::uint64_t key);
+
     /* Constructs the BVH tree using the Surface Area Heuristic as
      * published in
      * "On fast Construction of SAH-based Bounding Volume Hierarchies"
@@ -111,35 +188,58 @@ public:
         std::vector<Vec3fType> const & vertices,
         int max_threads = std::thread::hardware_concurrency());
 
+    /* Collapses the binary tree into a 4-wide tree, which is then used by the
+     * single ray traversal (the packet traversal keeps the binary one).
+     * It is cheap compared to the construction, and is not stored by save().
+     * Returns false (and keeps the binary traversal) if the wide tree would
+     * be too deep for the traversal stack. */
+    bool build_wide4(void);
+
     bool intersect(Ray ray, Hit * hit_ptr) const;
+
+    /* Traces the N (4, 8, 16...) coherent rays of the packet together,
+     * a node is visited as long as one of the lanes hits its aabb.
+     * hits has to hold N elements, a lane without a hit gets t = inf.
+     * Returns the bitmask of the lanes which hit a triangle. */
+    template <int N>
+    unsigned int intersect(RayPacket<N> const & packet, Hit * hits) const;
 };
 
 template <typename IdxType, typename Vec3fType>
 constexpr IdxType BVHTree<IdxType, Vec3fType>::NAI;
+template <typename IdxType, typename Vec3fType>
+constexpr int BVHTree<IdxType, Vec3fType>::STACK_SIZE;
+template <typename IdxType, typename Vec3fType>
+constexpr std::uint32_t BVHTree<IdxType, Vec3fType>::FILE_VERSION;
 
 #define NUM_BINS 64
 template <typename IdxType, typename Vec3fType>
 void BVHTree<IdxType, Vec3fType>::split(typename Node::ID node,
         std::vector<AABB> const & aabbs,
-        std::atomic<int> * num_threads) {
+        std::atomic<int> * num_threads, int depth) {
+
+    /* A node at the traversal stack's depth stays a leaf. */
+    if (depth >= STACK_SIZE - 1) return;
 
     typename Node::ID left, right;
     if ((*num_threads -= 1) >= 1) {
         std::tie(left, right) = sbsplit(node, aabbs);
         if (left != NAI && right != NAI) {
-            std::thread other(&BVHTree::split, this, left, std::cref(aabbs), num_threads);
-            split(right, aabbs, num_threads);
+            std::thread other(&BVHTree::split, this, left, std::cref(aabbs), num_threads, depth + 1);
+            split(right, aabbs, num_threads, depth + 1);
             other.join();
         }
     } else {
-        std::deque<typename Node::ID> queue;
-        queue.push_back(node);
+        std::deque<std::pair<typename Node::ID, int> > queue;
+        queue.emplace_back(node, depth);
         while (!queue.empty()) {
-            typename Node::ID node = queue.back(); queue.pop_back();
+            typename Node::ID node; int node_depth;
+            std::tie(node, node_depth) = queue.back(); queue.pop_back();
+            if (node_depth >= STACK_SIZE - 1) continue;
             std::tie(left, right) = sbsplit(node, aabbs);
             if (left != NAI && right != NAI) {
-                queue.push_back(left);
-                queue.push_back(right);
+                queue.emplace_back(left, node_depth + 1);
+                queue.emplace_back(right, node_depth + 1);
             }
         }
     }
@@ -341,21 +441,165 @@ BVHTree<IdxType, Vec3fType>::BVHTree(std::vector<IdxType> const & faces,
     }
 
     std::atomic<int> num_threads(max_threads);
-    split(0, aabbs, &num_threads);
+    split(0, aabbs, &num_threads, 1);
 
     tris.resize(ttris.size());
     for (std::size_t i = 0; i < indices.size(); ++i) {
-        tris[i] = ttris[indices[i]];
+        calculate_tri_accel(ttris[indices[i]], &tris[i]);
     }
 
     nodes.resize(num_nodes);
+    flatten();
+}
+
+template <typename IdxType, typename Vec3fType> void
+BVHTree<IdxType, Vec3fType>::flatten(void) {
+    flat_nodes.resize(nodes.size());
+
+    /* (node, parent's flat index) in depth first order, the parent of a
+     * right child gets its index when the child is placed. */
+    std::vector<std::pair<typename Node::ID, IdxType> > s;
+    s.emplace_back(0, NAI);
+    IdxType num_flat_nodes = 0;
+    while (!s.empty()) {
+        typename Node::ID node_id; IdxType parent;
+        std::tie(node_id, parent) = s.back(); s.pop_back();
+
+        Node const & node = nodes[node_id];
+        IdxType flat_id = num_flat_nodes++;
+        if (parent != NAI) flat_nodes[parent].second = flat_id;
+        FlatNode & flat_node = flat_nodes[flat_id];
+        flat_node.aabb = node.aabb;
+        if (node.left != NAI && node.right != NAI) {
+            flat_node.num = 0;
+            s.emplace_back(node.right, flat_id);
+            s.emplace_back(node.left, NAI);
+        } else {
+            flat_node.second = node.first;
+            flat_node.num = node.last - node.first;
+        }
+    }
+
+    nodes.clear();
+    nodes.shrink_to_fit();
 }
 
 template <typename IdxType, typename Vec3fType> bool
-BVHTree<IdxType, Vec3fType>::intersect(Ray const & ray, typename Node::ID node_id, Hit * hit) const {
-    Node const & node = nodes[node_id];
+BVHTree<IdxType, Vec3fType>::save(std::string const & filename, std::uint64_t key) const {
+    FileHeader header;
+    std::memcpy(header.magic, "ACCBVH\0\0", sizeof(header.magic));
+    header.version = FILE_VERSION;
+    header.idx_size = sizeof(IdxType);
+    header.key = key;
+    header.num_nodes = flat_nodes.size();
+    header.num_tris = tris.size();
+
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out.good()) return false;
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    out.write(reinterpret_cast<char const *>(flat_nodes.data()), flat_nodes.size() * sizeof(FlatNode));
+    out.write(reinterpret_cast<char const *>(indices.data()), indices.size() * sizeof(IdxType));
+    out.write(reinterpret_cast<char const *>(tris.data()), tris.size() * sizeof(TriAccel));
+    out.close();
+    return !out.fail();
+}
+
+template <typename IdxType, typename Vec3fType> bool
+BVHTree<IdxType, Vec3fType>::read(char const * data, std::size_t size, std::uint64_t key) {
+    FileHeader header;
+    if (size < sizeof(header)) return false;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, "ACCBVH\0\0", sizeof(header.magic)) != 0
+        || header.version != FILE_VERSION || header.idx_size != sizeof(IdxType)
+        || header.key != key || header.num_nodes == 0) {
+        return false;
+    }
+    std::size_t nodes_size = header.num_nodes * sizeof(FlatNode);
+    std::size_t indices_size = header.num_tris * sizeof(IdxType);
+    std::size_t tris_size = header.num_tris * sizeof(TriAccel);
+    if (size != sizeof(header) + nodes_size + indices_size + tris_size) return false;
+
+    data += sizeof(header);
+    flat_nodes.resize(header.num_nodes);
+    /* FlatNode only holds floats and indices (math::Vector has no other state). */
+    std::memcpy(static_cast<void *>(flat_nodes.data()), data, nodes_size);
+    data += nodes_size;
+    indices.resize(header.num_tris);
+    std::memcpy(indices.data(), data, indices_size);
+    data += indices_size;
+    tris.resize(header.num_tris);
+    std::memcpy(tris.data(), data, tris_size);
+    return valid();
+}
+
+/* Checks the structure of a read tree, so a corrupted file is rebuilt instead
+ * of being traversed out of bounds: in the depth first order an inner node's
+ * children follow it (which also excludes cycles), the leaves' ranges and the
+ * triangles' indices are within the triangles, and the tree isn't deeper
+ * than the construction allows. */
+template <typename IdxType, typename Vec3fType> bool
+BVHTree<IdxType, Vec3fType>::valid(void) const {
+    std::size_t num_flat_nodes = flat_nodes.size();
+    std::size_t num_tris = tris.size();
+    std::vector<int> depths(num_flat_nodes, 0);
+    depths[0] = 1;
+    for (std::size_t i = 0; i < num_flat_nodes; ++i) {
+        FlatNode const & node = flat_nodes[i];
+        if (node.num == 0) {
+            std::size_t right = static_cast<std::size_t>(node.second);
+            if (i + 1 >= num_flat_nodes || right <= i + 1 || right >= num_flat_nodes) return false;
+            /* The children have larger indices, so their depths are set before they're visited. */
+            if (depths[i] > 0) {
+                if (depths[i] + 1 > STACK_SIZE - 1) return false;
+                depths[i + 1] = depths[right] = depths[i] + 1;
+            }
+        } else {
+            std::uint64_t first = static_cast<std::uint64_t>(node.second);
+            if (first + static_cast<std::uint64_t>(node.num) > num_tris) return false;
+        }
+    }
+    for (std::size_t i = 0; i < indices.size(); ++i) {
+        if (static_cast<std::size_t>(indices[i]) >= num_tris) return false;
+    }
+    return true;
+}
+
+template <typename IdxType, typename Vec3fType>
+typename BVHTree<IdxType, Vec3fType>::Ptr
+BVHTree<IdxType, Vec3fType>::load(std::string const & filename, std::uint64_t key) {
+    Ptr bvh_tree(new BVHTree());
+    bool success = false;
+#if defined(__unix__)
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return Ptr();
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+        std::size_t size = static_cast<std::size_t>(st.st_size);
+        void * data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            success = bvh_tree->read(static_cast<char const *>(data), size, key);
+            ::munmap(data, size);
+        }
+    }
+    ::close(fd);
+#else
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.good()) return Ptr();
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    success = bvh_tree->read(data.data(), data.size(), key);
+#endif
+    return success ? bvh_tree : Ptr();
+}
+
+template <typename IdxType, typename Vec3fType> bool
+BVHTree<IdxType, Vec3fType>::intersect(Ray const & ray, FlatNode const & leaf, Hit * hit) const {
+    return intersect(ray, leaf.second, leaf.num, hit);
+}
+
+template <typename IdxType, typename Vec3fType> bool
+BVHTree<IdxType, Vec3fType>::intersect(Ray const & ray, IdxType first, IdxType num, Hit * hit) const {
     bool ret = false;
-    for (std::size_t i = node.first; i < node.last; ++i) {
+    for (std::size_t i = first; i < first + num; ++i) {
         float t;
         Vec3fType bcoords;
         if (acc::intersect(ray, tris[i], &t, &bcoords)) {
@@ -370,33 +614,181 @@ BVHTree<IdxType, Vec3fType>::intersect(Ray const & ray, typename Node::ID node_i
 }
 
 template <typename IdxType, typename Vec3fType> bool
-BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr) const {
+BVHTree<IdxType, Vec3fType>::build_wide4(void) {
+    wide_nodes.clear();
+    /* A single leaf, nothing to collapse. */
+    if (flat_nodes.empty() || flat_nodes[0].num != 0) return false;
+
+    /* (flat node, its wide node, depth) */
+    std::vector<std::tuple<IdxType, IdxType, int> > s;
+    wide_nodes.emplace_back();
+    s.emplace_back(0, 0, 1);
+    int max_depth = 0;
+    while (!s.empty()) {
+        IdxType flat_id, wide_id; int depth;
+        std::tie(flat_id, wide_id, depth) = s.back(); s.pop_back();
+        max_depth = std::max(max_depth, depth);
+
+        /* Pull up the grandchildren of the largest inner children. */
+        IdxType children[4] = {flat_id + 1, flat_nodes[flat_id].second, NAI, NAI};
+        int n = 2;
+        while (n < 4) {
+            int best = -1;
+            float best_area = -1.0f;
+            for (int i = 0; i < n; ++i) {
+                FlatNode const & child = flat_nodes[children[i]];
+                if (child.num == 0 && surface_area(child.aabb) > best_area) {
+                    best = i;
+                    best_area = surface_area(child.aabb);
+                }
+            }
+            if (best < 0) break;
+            IdxType inner = children[best];
+            children[best] = inner + 1;
+            children[n++] = flat_nodes[inner].second;
+        }
+
+        WideNode node;
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 6; ++j) node.bounds[j][i] = 0.0f;
+            node.child[i] = NAI;
+            node.num[i] = 0;
+            if (i >= n) continue;
+            FlatNode const & child = flat_nodes[children[i]];
+            for (int j = 0; j < 3; ++j) {
+                node.bounds[j][i] = child.aabb.min[j];
+                node.bounds[3 + j][i] = child.aabb.max[j];
+            }
+            if (child.num > 0) {
+                node.child[i] = child.second;
+                node.num[i] = child.num;
+            } else {
+                node.child[i] = wide_nodes.size();
+                wide_nodes.emplace_back();
+                s.emplace_back(children[i], node.child[i], depth + 1);
+            }
+        }
+        wide_nodes[wide_id] = node;
+    }
+
+    /* Every visited node pushes at most 3 more nodes than it pops. */
+    if (3 * max_depth + 1 > STACK_SIZE) {
+        wide_nodes.clear();
+    }
+    wide_nodes.shrink_to_fit();
+    return !wide_nodes.empty();
+}
+
+template <typename IdxType, typename Vec3fType> unsigned int
+BVHTree<IdxType, Vec3fType>::intersect_children(Ray const & ray, float const * inv_dir,
+    WideNode const & node, float * tmin_ptr) {
+    unsigned int mask = 0;
+#if defined(__SSE__)
+    __m128 tmin = _mm_set1_ps(ray.tmin);
+    __m128 tmax = _mm_set1_ps(ray.tmax);
+    for (int i = 0; i < 3; ++i) {
+        __m128 origin = _mm_set1_ps(ray.origin[i]);
+        __m128 inv = _mm_set1_ps(inv_dir[i]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[i]), origin), inv);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[3 + i]), origin), inv);
+        /* Operand order makes NaNs (0 * inf) fall back to the current bounds. */
+        tmin = _mm_max_ps(_mm_min_ps(t1, t2), tmin);
+        tmax = _mm_min_ps(_mm_max_ps(t1, t2), tmax);
+    }
+    _mm_storeu_ps(tmin_ptr, tmin);
+    mask = _mm_movemask_ps(_mm_cmpge_ps(tmax, _mm_max_ps(tmin, _mm_setzero_ps())));
+#else
+    for (int k = 0; k < 4; ++k) {
+        float tmin = ray.tmin, tmax = ray.tmax;
+        for (int i = 0; i < 3; ++i) {
+            float t1 = (node.bounds[i][k] - ray.origin[i]) * inv_dir[i];
+            float t2 = (node.bounds[3 + i][k] - ray.origin[i]) * inv_dir[i];
+            tmin = std::max(tmin, std::min(std::min(t1, t2), inf));
+            tmax = std::min(tmax, std::max(std::max(t1, t2), -inf));
+        }
+        tmin_ptr[k] = tmin;
+        if (tmax >= std::max(tmin, 0.0f)) mask |= 1u << k;
+    }
+#endif
+    for (int k = 0; k < 4; ++k) {
+        if (node.child[k] == NAI) mask &= ~(1u << k);
+    }
+    return mask;
+}
+
+template <typename IdxType, typename Vec3fType> bool
+BVHTree<IdxType, Vec3fType>::intersect_wide(Ray ray, Hit * hit_ptr) const {
     Hit hit;
     hit.t = std::numeric_limits<float>::infinity();
-    std::stack<typename Node::ID> s;
+    float inv_dir[3] = {1.0f / ray.dir[0], 1.0f / ray.dir[1], 1.0f / ray.dir[2]};
+    IdxType s[STACK_SIZE];
+    int top = 0;
+
+    s[top++] = 0;
+    while (top > 0) {
+        WideNode const & node = wide_nodes[s[--top]];
+        float tmin[4];
+        unsigned int mask = intersect_children(ray, inv_dir, node, tmin);
+
+        /* Sort the struck children near to far. */
+        int order[4], n = 0;
+        for (int k = 0; k < 4; ++k) {
+            if (!(mask & (1u << k))) continue;
+            int i = n++;
+            for (; i > 0 && tmin[order[i - 1]] > tmin[k]; --i) order[i] = order[i - 1];
+            order[i] = k;
+        }
 
-    s.push(0);
-    while (!s.empty()) {
-        typename Node::ID node_id = s.top(); s.pop();
-        Node const & node = nodes[node_id];
-        if (node.left != NAI && node.right != NAI) {
+        /* Leaves are tested right away, inner nodes are pushed far to near. */
+        for (int i = 0; i < n; ++i) {
+            int k = order[i];
+            if (node.num[k] > 0 && intersect(ray, node.child[k], node.num[k], &hit)) {
+                ray.tmax = hit.t;
+            }
+        }
+        for (int i = n - 1; i >= 0; --i) {
+            int k = order[i];
+            if (node.num[k] == 0 && tmin[k] <= ray.tmax) s[top++] = node.child[k];
+        }
+    }
+
+    *hit_ptr = hit;
+
+    return hit.t < std::numeric_limits<float>::infinity();
+}
+
+template <typename IdxType, typename Vec3fType> bool
+BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr) const {
+    if (!wide_nodes.empty()) return intersect_wide(ray, hit_ptr);
+
+    Hit hit;
+    hit.t = std::numeric_limits<float>::infinity();
+    IdxType s[STACK_SIZE];
+    int top = 0;
+
+    s[top++] = 0;
+    while (top > 0) {
+        IdxType node_id = s[--top];
+        FlatNode const & node = flat_nodes[node_id];
+        if (node.num == 0) {
+            IdxType left_id = node_id + 1, right_id = node.second;
             float tmin_left, tmin_right;
-            bool left = acc::intersect(ray, nodes[node.left].aabb, &tmin_left);
-            bool right = acc::intersect(ray, nodes[node.right].aabb, &tmin_right);
+            bool left = acc::intersect(ray, flat_nodes[left_id].aabb, &tmin_left);
+            bool right = acc::intersect(ray, flat_nodes[right_id].aabb, &tmin_right);
             if (left && right) {
                 if (tmin_left < tmin_right) {
-                    s.push(node.right);
-                    s.push(node.left);
+                    s[top++] = right_id;
+                    s[top++] = left_id;
                 } else {
-                    s.push(node.left);
-                    s.push(node.right);
+                    s[top++] = left_id;
+                    s[top++] = right_id;
                 }
             } else {
-                if (right) s.push(node.right);
-                if (left) s.push(node.left);
+                if (right) s[top++] = right_id;
+                if (left) s[top++] = left_id;
             }
         } else {
-            if (intersect(ray, node_id, &hit)) {
+            if (intersect(ray, node, &hit)) {
                 ray.tmax = hit.t;
             }
         }
@@ -407,6 +799,66 @@ BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr) const {
     return hit.t < std::numeric_limits<float>::infinity();
 }
 
+template <typename IdxType, typename Vec3fType> template <int N> unsigned int
+BVHTree<IdxType, Vec3fType>::intersect(RayPacket<N> & packet, FlatNode const & leaf, Hit * hits) const {
+    unsigned int ret = 0;
+    float t[N];
+    float bcoords[3][N];
+    for (std::size_t i = leaf.second; i < leaf.second + leaf.num; ++i) {
+        unsigned int mask = acc::intersect(packet, tris[i], t, bcoords);
+        for (int k = 0; mask != 0; ++k, mask >>= 1) {
+            if (!(mask & 1u) || t[k] > hits[k].t) continue;
+            hits[k].idx = indices[i];
+            hits[k].t = t[k];
+            hits[k].bcoords = Vec3fType(bcoords[0][k], bcoords[1][k], bcoords[2][k]);
+            packet.tmax[k] = t[k];
+            ret |= 1u << k;
+        }
+    }
+    return ret;
+}
+
+template <typename IdxType, typename Vec3fType> template <int N> unsigned int
+BVHTree<IdxType, Vec3fType>::intersect(RayPacket<N> const & packet_ref, Hit * hits) const {
+    for (int k = 0; k < N; ++k) {
+        hits[k].t = std::numeric_limits<float>::infinity();
+    }
+    RayPacket<N> packet = packet_ref;
+    packet.calculate_inv_dir();
+
+    unsigned int ret = 0;
+    IdxType s[STACK_SIZE];
+    int top = 0;
+
+    s[top++] = 0;
+    while (top > 0) {
+        IdxType node_id = s[--top];
+        FlatNode const & node = flat_nodes[node_id];
+        if (node.num == 0) {
+            IdxType left_id = node_id + 1, right_id = node.second;
+            float tmin_left, tmin_right;
+            bool left = acc::intersect(packet, flat_nodes[left_id].aabb, &tmin_left) != 0;
+            bool right = acc::intersect(packet, flat_nodes[right_id].aabb, &tmin_right) != 0;
+            if (left && right) {
+                if (tmin_left < tmin_right) {
+                    s[top++] = right_id;
+                    s[top++] = left_id;
+                } else {
+                    s[top++] = left_id;
+                    s[top++] = right_id;
+                }
+            } else {
+                if (right) s[top++] = right_id;
+                if (left) s[top++] = left_id;
+            }
+        } else {
+            ret |= intersect(packet, node, hits);
+        }
+    }
+
+    return ret;
+}
+
 ACC_NAMESPACE_END
 
 #endif /* ACC_BVHTREE_HEADER */
@@ -10,6 +10,11 @@
 #define ACC_PRIMITIVES_HEADER
 
 #include <limits>
+#include <cmath>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
 
 #include <math/vector.h>
 
@@ -31,6 +36,14 @@ struct Tri {
     Vec3fType c;
 };
 
+/* Triangle stored as the rows of the affine transformation which maps it
+ * onto the unit triangle of the xy-plane (see calculate_tri_accel), a
+ * triangle's 12 floats are kept together (48 bytes, a leaf's triangles are
+ * contiguous in the order of the indices). */
+struct TriAccel {
+    float m[3][4];
+};
+
 template <typename Vec3fType>
 struct Ray {
     Vec3fType origin;
@@ -39,6 +52,25 @@ struct Ray {
     float tmax;
 };
 
+/* A packet of N coherent rays stored as structure of arrays,
+ * lane k of the packet is the ray (origin[.][k], dir[.][k]). */
+template <int N>
+struct alignas(32) RayPacket {
+    float origin[3][N];
+    float dir[3][N];
+    float inv_dir[3][N];
+    float tmin[N];
+    float tmax[N];
+
+    void calculate_inv_dir(void) {
+        for (int i = 0; i < 3; ++i) {
+            for (int k = 0; k < N; ++k) {
+                inv_dir[i][k] = 1.0f / dir[i][k];
+            }
+        }
+    }
+};
+
 template <typename Vec3fType> inline
 AABB<Vec3fType> operator+(AABB<Vec3fType> const & a, AABB<Vec3fType> const & b) {
     AABB<Vec3fType> aabb;
@@ -65,6 +97,44 @@ void calculate_aabb(Tri<Vec3fType> const & tri, AABB<Vec3fType> * aabb)  {
     }
 }
 
+/* Derived from "Fast Ray-Triangle Intersections by Coordinate Transformation"
+ * by Doug Baldwin and Michael Weber (Journal of Computer Graphics Techniques 2016).
+ * The triangle's edges e1, e2 and the axis of the normal's largest component
+ * span the space, the rows are the inverse of this basis (translated to tri.a):
+ * rows 0, 1 give the barycentric coordinates of b and c, row 2 the distance
+ * to the triangle's plane. Degenerated triangles never get hit. */
+template <typename Vec3fType> inline
+void calculate_tri_accel(Tri<Vec3fType> const & tri, TriAccel * accel) {
+    Vec3fType e1 = tri.b - tri.a;
+    Vec3fType e2 = tri.c - tri.a;
+    Vec3fType normal = e1.cross(e2);
+
+    int k = 0;
+    for (int i = 1; i < 3; ++i) {
+        if (std::abs(normal[i]) > std::abs(normal[k])) k = i;
+    }
+    if (normal.norm() < std::numeric_limits<float>::epsilon()) {
+        for (int r = 0; r < 3; ++r) {
+            for (int i = 0; i < 4; ++i) {
+                accel->m[r][i] = 0.0f;
+            }
+        }
+        accel->m[2][3] = std::numeric_limits<float>::quiet_NaN();
+        return;
+    }
+
+    Vec3fType axis(0.0f);
+    axis[k] = 1.0f;
+    Vec3fType rows[3] = {e2.cross(axis), axis.cross(e1), normal};
+    for (int r = 0; r < 3; ++r) {
+        rows[r] = rows[r] / normal[k];
+        for (int i = 0; i < 3; ++i) {
+            accel->m[r][i] = rows[r][i];
+        }
+        accel->m[r][3] = -rows[r].dot(tri.a);
+    }
+}
+
 template <typename Vec3fType> inline
 float surface_area(AABB<Vec3fType> const & aabb) {
     float e0 = aabb.max[0] - aabb.min[0];
@@ -99,34 +169,24 @@ bool intersect(Ray<Vec3fType> const & ray, AABB<Vec3fType> const & aabb, float *
 }
 
 template <typename Vec3fType> inline
-bool intersect(Ray<Vec3fType> const & ray, Tri<Vec3fType> const & tri, float * t_ptr, Vec3fType * bcoords_ptr) {
-    Vec3fType v0 = tri.b - tri.a;
-    Vec3fType v1 = tri.c - tri.a;
-    Vec3fType normal = v1.cross(v0);
-    if (normal.norm() < std::numeric_limits<float>::epsilon()) return false;
-    normal.normalize();
-
-    double cosine = normal.dot(ray.dir);
-    if (std::abs(cosine) < std::numeric_limits<double>::epsilon()) return false;
-
-    float t = -normal.dot(ray.origin - tri.a) / cosine;
-
-    if (t < ray.tmin || ray.tmax < t) return false;
-    Vec3fType v2 = (ray.origin - tri.a) + t * ray.dir;
-
-    /* Derived from the book "Real-Time Collision Detection"
-     * by Christer Ericson published by Morgan Kaufmann in 2005 */
-    float d00 = v0.dot(v0);
-    float d01 = v0.dot(v1);
-    float d11 = v1.dot(v1);
-    float d20 = v2.dot(v0);
-    float d21 = v2.dot(v1);
-    double denom = d00 * d11 - d01 * d01;
+bool intersect(Ray<Vec3fType> const & ray, TriAccel const & tri, float * t_ptr, Vec3fType * bcoords_ptr) {
+    float const (&m)[3][4] = tri.m;
+    float ow = m[2][0] * ray.origin[0] + m[2][1] * ray.origin[1] + m[2][2] * ray.origin[2] + m[2][3];
+    float dw = m[2][0] * ray.dir[0] + m[2][1] * ray.dir[1] + m[2][2] * ray.dir[2];
+    float t = -ow / dw;
+
+    /* Written as negation to reject NaNs as well. */
+    if (!(ray.tmin <= t && t <= ray.tmax)) return false;
+
+    float u = m[0][0] * ray.origin[0] + m[0][1] * ray.origin[1] + m[0][2] * ray.origin[2] + m[0][3]
+        + t * (m[0][0] * ray.dir[0] + m[0][1] * ray.dir[1] + m[0][2] * ray.dir[2]);
+    float v = m[1][0] * ray.origin[0] + m[1][1] * ray.origin[1] + m[1][2] * ray.origin[2] + m[1][3]
+        + t * (m[1][0] * ray.dir[0] + m[1][1] * ray.dir[1] + m[1][2] * ray.dir[2]);
 
     Vec3fType bcoords;
-    bcoords[1] = (d11 * d20 - d01 * d21) / denom;
-    bcoords[2] = (d00 * d21 - d01 * d20) / denom;
-    bcoords[0] = 1.0f - bcoords[1] - bcoords[2];
+    bcoords[0] = 1.0f - u - v;
+    bcoords[1] = u;
+    bcoords[2] = v;
 
     *t_ptr = t;
     *bcoords_ptr = bcoords;
@@ -136,6 +196,90 @@ bool intersect(Ray<Vec3fType> const & ray, Tri<Vec3fType> const & tri, float * t
         && -eps <= bcoords[2] && bcoords[2] <= 1.0f + eps;
 }
 
+/* Slab test of all lanes of the packet against the aabb (inv_dir has to be
+ * calculated). Returns the bitmask of the lanes which hit the aabb and
+ * the nearest entry distance of these lanes in tmin_ptr. */
+template <typename Vec3fType, int N> inline
+unsigned int intersect(RayPacket<N> const & packet, AABB<Vec3fType> const & aabb, float * tmin_ptr) {
+    static_assert(N <= 32, "Packets are limited to 32 lanes");
+    unsigned int mask = 0;
+    float near = inf;
+    int k = 0;
+#if defined(__SSE__)
+    for (; k + 4 <= N; k += 4) {
+        __m128 tmin = _mm_loadu_ps(packet.tmin + k);
+        __m128 tmax = _mm_loadu_ps(packet.tmax + k);
+        for (int i = 0; i < 3; ++i) {
+            __m128 origin = _mm_loadu_ps(packet.origin[i] + k);
+            __m128 inv_dir = _mm_loadu_ps(packet.inv_dir[i] + k);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.min[i]), origin), inv_dir);
+            __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.max[i]), origin), inv_dir);
+            /* Operand order makes NaNs (0 * inf) fall back to the current bounds. */
+            tmin = _mm_max_ps(_mm_min_ps(t1, t2), tmin);
+            tmax = _mm_min_ps(_mm_max_ps(t1, t2), tmax);
+        }
+        __m128 hit = _mm_cmpge_ps(tmax, _mm_max_ps(tmin, _mm_setzero_ps()));
+        mask |= static_cast<unsigned int>(_mm_movemask_ps(hit)) << k;
+        __m128 t = _mm_or_ps(_mm_and_ps(hit, tmin), _mm_andnot_ps(hit, _mm_set1_ps(inf)));
+        t = _mm_min_ps(t, _mm_movehl_ps(t, t));
+        t = _mm_min_ss(t, _mm_shuffle_ps(t, t, 1));
+        near = std::min(near, _mm_cvtss_f32(t));
+    }
+#endif
+    for (; k < N; ++k) {
+        float tmin = packet.tmin[k], tmax = packet.tmax[k];
+        for (int i = 0; i < 3; ++i) {
+            float t1 = (aabb.min[i] - packet.origin[i][k]) * packet.inv_dir[i][k];
+            float t2 = (aabb.max[i] - packet.origin[i][k]) * packet.inv_dir[i][k];
+
+            tmin = std::max(tmin, std::min(std::min(t1, t2), inf));
+            tmax = std::min(tmax, std::max(std::max(t1, t2), -inf));
+        }
+        if (tmax >= std::max(tmin, 0.0f)) {
+            mask |= 1u << k;
+            near = std::min(near, tmin);
+        }
+    }
+    *tmin_ptr = near;
+    return mask;
+}
+
+/* Tests all lanes of the packet against the triangle, the lane loop is
+ * left to the vectorizer. Returns the bitmask of the lanes which hit it. */
+template <int N> inline
+unsigned int intersect(RayPacket<N> const & packet, TriAccel const & tri,
+    float * t_ptr, float (*bcoords_ptr)[N]) {
+    float const (&m)[3][4] = tri.m;
+    int valid[N];
+#pragma omp simd
+    for (int k = 0; k < N; ++k) {
+        float ox = packet.origin[0][k], oy = packet.origin[1][k], oz = packet.origin[2][k];
+        float dx = packet.dir[0][k], dy = packet.dir[1][k], dz = packet.dir[2][k];
+        float t = -(m[2][0] * ox + m[2][1] * oy + m[2][2] * oz + m[2][3])
+            / (m[2][0] * dx + m[2][1] * dy + m[2][2] * dz);
+        float u = m[0][0] * ox + m[0][1] * oy + m[0][2] * oz + m[0][3]
+            + t * (m[0][0] * dx + m[0][1] * dy + m[0][2] * dz);
+        float v = m[1][0] * ox + m[1][1] * oy + m[1][2] * oz + m[1][3]
+            + t * (m[1][0] * dx + m[1][1] * dy + m[1][2] * dz);
+        float w = 1.0f - u - v;
+
+        t_ptr[k] = t;
+        bcoords_ptr[0][k] = w;
+        bcoords_ptr[1][k] = u;
+        bcoords_ptr[2][k] = v;
+        valid[k] = packet.tmin[k] <= t && t <= packet.tmax[k]
+            && -eps <= w && w <= 1.0f + eps
+            && -eps <= u && u <= 1.0f + eps
+            && -eps <= v && v <= 1.0f + eps;
+    }
+
+    unsigned int mask = 0;
+    for (int k = 0; k < N; ++k) {
+        mask |= static_cast<unsigned int>(valid[k] != 0) << k;
+    }
+    return mask;
+}
+
 ACC_NAMESPACE_END
 
 #endif /* ACC_PRIMITIVES_HEADER */
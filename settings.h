@@ -10,19 +10,20 @@ class Settings
 {
 public:
     int originImgW, originImgH, originDepthW, originDepthH, imgW, imgH, scaleInitW, scaleInitH;
-    int patchWidth, patchStep, patchSize, frameStart, frameEnd;
+    int patchWidth, patchStep, patchSize, patchTileSize, frameStart, frameEnd;
+    int rayPacketSize, covisibilityStride, patchmatchColdSweeps, patchmatchWarmSweeps;
     double scaleFactor, alpha_u, alpha_v, lamda, patchRandomSearchTimes;
-    size_t scaleTimes;
+    size_t scaleTimes, neighbourViews, randomSeed;
     std::vector<size_t> kfIndexs, scaleIters;
 
     std::string resultsPathSurfix;
     std::string allFramesPath, cameraTxtFile, camTrajNamePattern;
     std::string keyFramesPath, kfCameraTxtFile, patchmatchBinFile, originResolution, plyFile;
     std::string rgbNamePattern, dNamePattern, kfRGBNamePattern, kfDNamePattern, rgbNameExt, kfRGBMatch;
-    bool camTrajFromWorldToCam;
+    bool camTrajFromWorldToCam, patchmatchWarmStart, bvhCache, bvhWide, validMeshFromOrigin, validCosAlpha, remapOnTheFly;
     float cameraDFx, cameraDFy, cameraDCx, cameraDCy, cameraFx, cameraFy, cameraCx, cameraCy;
     cv::Mat1f cameraK, cameraDK;
-    char depthType;
+    char depthType, visibilityType;
 
     Settings()
     {
@@ -108,6 +109,34 @@ public:
         scaleIters = {50, 45, 40, 35, 30, 25, 20, 15, 10, 5};
         scaleInitH = originImgH / 4;
 
+        // set the method to find each pixel's visible face when calculating the valid mesh
+        //  r - ray casting (with the BVH)  z - rasterization (with the z-buffer)
+        visibilityType = 'r';
+        // store the BVH of the mesh next to the ply file, and reuse it while the mesh isn't changed
+        bvhCache = true;
+        // trace the single rays through a 4-wide BVH, testing the 4 children's boxes at once
+        //  (only built when the rays are casted one by one, see rayPacketSize, the packets use the binary BVH)
+        bvhWide = false;
+        // calculate the valid mesh only once at the origin resolution, and reduce it to every scale
+        //  (otherwise the rays are casted again at each scale)
+        validMeshFromOrigin = false;
+        // keep each pixel's cos of the angle between the camera dir and the face's normal in the valid info
+        //  (as half floats, the weights already include it)
+        validCosAlpha = false;
+        // the number of rays casted together as a packet when calculating the valid mesh
+        //  (4, 8 or 16 pixels' tile, otherwise every ray is casted alone)
+        rayPacketSize = 16;
+        // don't store the pixels' correspondences between the views, but find them again from the pixels' samples each time
+        //  they're used (only the sample of each pixel is kept, so the memory only grows linearly with the number of views,
+        //  while the projections are repeated every iteration), the correspondences are the same as the stored ones
+        remapOnTheFly = false;
+        // rank the covisible views for neighbourViews by remapping every covisibilityStride pixel
+        //  (0 ranks them by the viewing angle only, the pairs which can't see a common surface are skipped anyway)
+        covisibilityStride = 4;
+        // the number of neighbour views (ranked by the overlap and the viewing angle) each view is blended with
+        //  (0 uses every covisible view)
+        neighbourViews = 0;
+
         // the width and height of a patch
         patchWidth = 7;
         // the step of patchs when voting
@@ -115,6 +144,18 @@ public:
         // the times of range when random searching in patchmatch
         //  searching window's width = patchRandomSearchTimes * sqrt(imgW * imgH)
         patchRandomSearchTimes = 0.01;
+        // the width and height of a tile of patches, the tiles of a checkerboard's colour are swept by the threads in parallel
+        //  (halved at the coarse scales while there are too few tiles for the threads, e.g. 8 gives ~1200 tiles for a 320x240 image)
+        patchTileSize = 8;
+        // the seed of the random search in patchmatch
+        //  the random numbers only depend on the seed, so the same seed gives the same results with any number of threads
+        randomSeed = 0;
+        // keep each view's NNFs between the iterations (upsampled between the scales) as patchmatch's initial guess,
+        //  instead of starting from the identity every time (costs two cv::Vec3i images per view)
+        patchmatchWarmStart = true;
+        // the sweeps of patchmatch from the identity, and from the last NNF
+        patchmatchColdSweeps = 6;
+        patchmatchWarmSweeps = 2;
 
         // weight the similarity from Si to Ti
         alpha_u = 1.0;
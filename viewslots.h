@@ -0,0 +1,59 @@
+#ifndef VIEWSLOTS_H
+#define VIEWSLOTS_H
+
+#include <cstddef>
+#include <vector>
+
+// the per-view data of the key frames, stored contiguously by the view's slot (its position in kfIndexs)
+//  a key frame's id is mapped to its slot by a plain table, so it's still accessed by the id as the std::map was,
+//  while the loops over the views (or the correspondences, which store the slot) index the data directly
+template <typename T>
+class ViewSlots
+{
+public:
+    // the key frames' ids in the order of their slots, every view's data is reset
+    void init(std::vector<size_t> const &ids)
+    {
+        size_t max_id = 0;
+        for ( size_t id : ids )
+            max_id = id > max_id ? id : max_id;
+        slots.assign(ids.empty() ? 0 : max_id + 1, static_cast<size_t>(NO_SLOT));
+        for ( size_t s = 0; s < ids.size(); s++ )
+            slots[ids[s]] = s;
+        data.assign(ids.size(), T());
+    }
+
+    // by the key frame's id
+    T & operator[](size_t id) { return data[slots[id]]; }
+    T const & operator[](size_t id) const { return data[slots[id]]; }
+    bool has(size_t id) const { return id < slots.size() && slots[id] != NO_SLOT; }
+    size_t slot(size_t id) const { return slots[id]; }
+
+    // by the slot
+    T & atSlot(size_t s) { return data[s]; }
+    T const & atSlot(size_t s) const { return data[s]; }
+    size_t size() const { return data.size(); }
+    T * begin() { return data.data(); }
+    T * end() { return data.data() + data.size(); }
+    T const * begin() const { return data.data(); }
+    T const * end() const { return data.data() + data.size(); }
+
+    // reset every view's data (the slots are kept)
+    void clear()
+    {
+        for ( T & d : data )
+            d = T();
+    }
+    void swap(ViewSlots &other)
+    {
+        data.swap(other.data);
+        slots.swap(other.slots);
+    }
+
+private:
+    static const size_t NO_SLOT = static_cast<size_t>(-1);
+    std::vector<T> data;
+    std::vector<size_t> slots; // id => slot
+};
+
+#endif // VIEWSLOTS_H